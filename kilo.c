@@ -1,27 +1,44 @@
 /*** includes ***/
 
+// Required to allow getline() to succeed cross-platform.
+// While it succeeded for me on MacOS Sequoia during development,
+// I'm not sure that's really cross platform without these additional
+// definitions. They have to come before any header is included.
+#define _DEFAULT_SOURCE
+#define _BSD_SOURCE
+#define _GNU_SOURCE
+
+#include <assert.h>
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
+#ifdef __linux__
+#include <sys/xattr.h>
+#endif
 
-/*** defines ***/
+// macOS calls the nanosecond file times by another name.
+#ifdef __APPLE__
+#define st_mtim st_mtimespec
+#endif
 
-// Required to allow getline() to succeed cross-platform.
-// While it succeeded for me on MacOS Sequoia during development,
-// I'm not sure that's really cross platform without these additional
-// definitions.
-#define _DEFAULT_SOURCE
-#define _BSD_SOURCE
-#define _GNU_SOURCE
+/*** defines ***/
 
 // Bitwise AND of the input key (in ASCII) with 0001 1111
 // to cast the first 3 bits to 0, which is how ASCII maps
@@ -39,6 +56,37 @@
 
 #define KILO_QUIT_TIMES 3
 
+// The smallest capacity a growing buffer is given.
+#define KILO_MIN_CAPACITY 16
+
+// Files are loaded by several threads in parts of at least
+// KILO_LOAD_PART_MIN bytes, one part per CPU, up to KILO_LOAD_PARTS_MAX.
+// The rest of a large file is loaded in the background in parts of
+// KILO_LOAD_PART_MIN bytes, by up to that many threads.
+#define KILO_LOAD_PART_MIN (64 << 20)
+#define KILO_LOAD_PARTS_MAX 64
+
+// Files larger than this are shown once their first KILO_LOAD_PREFIX bytes
+// are loaded, while the rest loads in the background.
+#define KILO_LOAD_PREFIX (1 << 20)
+
+// Line endings found in a file (see editorEolExtra).
+#define EOL_LF (1 << 0)
+#define EOL_CRLF (1 << 1)
+
+// Files are mapped with room to grow by this much, so that a file saved in
+// place can keep its mapping (see editorSaveInPlace).
+#define KILO_MAP_SLACK (1 << 20)
+
+// editorSave hands rows to writev() in batches of up to KILO_SAVE_IOVS
+// pieces (the usual IOV_MAX) and KILO_SAVE_BATCH bytes.
+#define KILO_SAVE_IOVS 1024
+#define KILO_SAVE_BATCH (1 << 30)
+
+// Rows saved in place that have to be written backwards go through a bounce
+// buffer of this size (see editorWriteInPlace).
+#define KILO_SAVE_BOUNCE (1 << 20)
+
 // Enum to map ints to key names.
 // These values are outside of the standard char range to avoid conflicts
 enum editorKey {
@@ -74,6 +122,13 @@ enum editorHighlight {
 #define HL_HIGHLIGHT_NUMBERS (1 << 0)
 #define HL_HIGHLIGHT_STRINGS (1 << 1)
 
+/*
+ * Rows whose rendered text is longer than this keep their highlighting as
+ * runs of one category (hlspan) instead of one byte per rendered character,
+ * whenever the runs take up less room.
+ */
+#define KILO_HL_FLAT_MAX 256
+
 /*** data ***/
 
 /*
@@ -100,19 +155,333 @@ struct editorSyntax {
   int flags;
 };
 
+/*
+ * A run of rendered characters sharing one highlight category.
+ */
+typedef struct hlspan {
+  size_t start;
+  size_t len;
+  unsigned char hl;
+} hlspan;
+
 /*
  * hold a single row of editor text
+ * The text of every row, its size and its ROW_* content flags live in the
+ * arrays of its leaf (see struct rownode), which is all most rows ever need.
+ * An erow holds the rest: what a row needs once it is displayed or edited.
+ * Rows are only given one then (see editorRowAt), and rows read from a file
+ * lose theirs again when their render and hl are evicted (see
+ * editorRowEvict).
+ * chars, render and hl all live in one allocation, in that order, starting
+ * at block: cap bytes of raw text (including the gap and the \0 byte),
+ * followed by rcap bytes of rendered text and hlcap bytes of highlighting.
+ * hl holds one category per rendered character, or nspans hlspans when the
+ * row has ROW_HL_SPANS set.
+ * Rows loaded from a mapped file (ROW_MAPPED) point chars into the mapping
+ * instead, without a \0 byte, and their block only holds render and hl. The
+ * same goes for interned rows (ROW_INTERNED), except that their text does
+ * end in a \0 byte.
+ * Freeing a row's block is a single free(), and drawing a row reads one
+ * contiguous block of memory.
  */
 typedef struct erow {
+  // The tree leaf holding the row and the row's position in it, which is
+  // where the row's text and its index in the document are found (see
+  // editorRowIndex). editorLeafMove keeps them up to date.
+  struct rownode *leaf;
   int idx;
-  int size;
-  int rsize;
-  char *chars;
+  // ROW_* flags describing which of the row's derived data is up to date.
+  int flags;
+  size_t rsize;
+  // Sizes of the chars, render and hl regions of the row's allocation, and
+  // the size of the allocation itself (see editorBlockAlloc).
+  size_t cap;
+  size_t rcap;
+  size_t hlcap;
+  size_t bsize;
+  char *block;
   char *render;
   unsigned char *hl;
-  int hl_open_comment;
+  size_t nspans;
+  // Neighbours in the list of rows whose render and hl were used, most
+  // recently used first (see editorRowTouch). Rows not on it have NULL in
+  // both and are not E.lruhead.
+  struct erow *lruprev;
+  struct erow *lrunext;
+  // Start and length of the unused gap inside chars, for the row that is
+  // currently being edited. The gap takes up all of the spare capacity of the
+  // row. Rows without a gap have gap == size and gaplen == 0.
+  size_t gap;
+  size_t gaplen;
 } erow;
 
+/*
+ * render and hl are built lazily, the first time a row is drawn or searched,
+ * and are thrown away (marked stale) whenever the row changes.
+ * Flags kept in erow.flags:
+ * - ROW_RENDERED: render matches chars.
+ * - ROW_RENDER_ALIAS: the row has no tabs, so render points at chars instead
+ *   of a copy of its own, and the block has no render region.
+ * - ROW_HL_SPANS: hl is stored as runs (see KILO_HL_FLAT_MAX).
+ * - ROW_SHARED: the row's block may also be read through a snapshot, so it
+ *   must be copied before it is changed in place, and must not be freed
+ *   while any snapshot is alive (see struct snapshot and editorRowShared).
+ * Flags kept in the leaf's flags array, for every row:
+ * - ROW_MAPPED: chars is a read only view into E.map, or into E.intern with
+ *   ROW_INTERNED also set (see editorRowOwn).
+ * - ROW_DIRTY: the row was added, or its contents changed, since the file
+ *   was opened or saved.
+ * - ROW_HASHED: the row's entries in its leaf's savedhash and savedsize
+ *   arrays are filled in.
+ * - ROW_INTERNED: see ROW_MAPPED.
+ */
+#define ROW_RENDERED (1 << 0)
+#define ROW_RENDER_ALIAS (1 << 1)
+#define ROW_HL_SPANS (1 << 2)
+#define ROW_MAPPED (1 << 3)
+#define ROW_SHARED (1 << 4)
+#define ROW_DIRTY (1 << 5)
+#define ROW_HASHED (1 << 6)
+#define ROW_INTERNED (1 << 7)
+
+/*
+ * The text, size and content flags of a row with an erow, from its leaf.
+ */
+#define ROW_CHARS(row) ((row)->leaf->chars[(row)->idx])
+#define ROW_SIZE(row) ((row)->leaf->size[(row)->idx])
+#define ROW_FLAGS(row) ((row)->leaf->flags[(row)->idx])
+
+/*
+ * Highlighting state, kept per row in its leaf's hlstate array (see struct
+ * rownode) so that walking it for many rows doesn't touch the rows.
+ * - ROW_HIGHLIGHTED: hl matches render, given the multiline comment state
+ *   recorded in ROW_HL_IN_COMMENT.
+ * - ROW_HL_IN_COMMENT: whether hl was worked out starting inside a multiline
+ *   comment.
+ * - ROW_HL_OPEN_COMMENT: whether the row ends inside a multiline comment.
+ */
+#define ROW_HIGHLIGHTED (1 << 0)
+#define ROW_HL_IN_COMMENT (1 << 1)
+#define ROW_HL_OPEN_COMMENT (1 << 2)
+
+/*
+ * The hl region starts on a size_t boundary so it can hold hlspans.
+ */
+#define ROW_HL_OFFSET(n) (((n) + 7) & ~(size_t)7)
+
+/*
+ * Read the character at position j of a row, stepping over the row's gap.
+ */
+#define ROW_CHAR(row, j)                                                       \
+  (ROW_CHARS(row)[(j) < (row)->gap ? (j) : (j) + (row)->gaplen])
+
+/*
+ * The document is stored as a balanced tree of rows (a B+tree).
+ * Leaves hold up to KILO_LEAF_ROWS rows each and are linked to their
+ * neighbors so the rows can be walked in order. Internal nodes hold up to
+ * KILO_NODE_FANOUT children. Every node knows how many rows are in its
+ * subtree, which lets us find "row N" in O(log n) steps, and inserting or
+ * deleting a row only moves the rows of a single leaf.
+ */
+#define KILO_LEAF_ROWS 256
+#define KILO_LEAF_ROW_BYTES (sizeof(char *) + sizeof(size_t) + 2)
+#define KILO_LEAF_HASH_BYTES (sizeof(uint64_t) + sizeof(size_t))
+#define KILO_NODE_FANOUT 32
+
+struct rownode {
+  // Number of trees referencing the node: the live tree and any snapshots
+  // (see struct snapshot). Nodes with refs > 1 are never changed in place.
+  int refs;
+  struct rownode *parent;
+  // 1 for leaves, which hold rows, and 0 for internal nodes, which hold
+  // child nodes.
+  int leaf;
+  // Number of rows (leaf) or children (internal node) held directly.
+  int n;
+  // Number of rows the leaf's arrays have room for.
+  int cap;
+  // Total number of rows in the subtree.
+  size_t count;
+  // Total number of bytes in the subtree, counting a newline after every row
+  // as in the saved file. Together with count, this maps between rows and
+  // file offsets in O(log n) (see editorRowOffset).
+  size_t bytes;
+  // Neighboring leaves, for walking the rows in order.
+  struct rownode *prev;
+  struct rownode *next;
+  // Child nodes (internal nodes only).
+  struct rownode *child[KILO_NODE_FANOUT];
+  // The rows of a leaf (leaves only), up to KILO_LEAF_ROWS of them, in
+  // parallel arrays so that operations scanning many rows (saving, hashing,
+  // finding a row by offset) read just what they need: the text of each row,
+  // its size, its ROW_* content flags and its ROW_HL_* highlighting state.
+  // The four arrays share one block of KILO_LEAF_ROW_BYTES per row, starting
+  // at chars (see editorLeafReserve).
+  char **chars;
+  size_t *size;
+  unsigned char *flags;
+  unsigned char *hlstate;
+  // The erow of each row that has one, and NULL for the others. Most leaves
+  // have no row displayed or edited, so this is only allocated once one of
+  // the leaf's rows gets an erow (see editorLeafRow), and is NULL until then.
+  erow **erows;
+  // The hash and size of each row's contents as last opened or saved, for
+  // rows with ROW_HASHED (see editorRowChanging). Most leaves never have a
+  // row hashed, so these are only allocated once one is (see
+  // editorLeafHashes), and are NULL until then. The two share one block of
+  // KILO_LEAF_HASH_BYTES per row, starting at savedhash.
+  uint64_t *savedhash;
+  size_t *savedsize;
+};
+
+/*
+ * Row blocks are carved out of large chunks owned by the buffer, rather than
+ * being malloc'd one by one, so that a whole buffer can be released by
+ * freeing its chunks.
+ * - Rows loaded from a file are bump allocated at their exact size.
+ * - Rows that are edited later get blocks from power-of-two size classes
+ *   (slabs), which are recycled through per-class free lists.
+ * - Blocks larger than the biggest size class come from malloc, and are kept
+ *   on a list so they can be released with the rest of the buffer.
+ */
+#define KILO_ARENA_CHUNK (1 << 20)
+#define KILO_SLAB_MIN 16
+#define KILO_SLAB_CLASSES 13
+#define KILO_SLAB_MAX (KILO_SLAB_MIN << (KILO_SLAB_CLASSES - 1))
+
+struct largeblock {
+  struct largeblock *prev;
+  struct largeblock *next;
+  size_t size;
+};
+
+struct rowarena {
+  // Chunks of memory that blocks are carved from.
+  char **chunks;
+  int nchunks;
+  // Bump pointer into the newest chunk and the bytes left after it.
+  char *bump;
+  size_t bumpleft;
+  // Free blocks, one list per size class, linked through their first bytes.
+  void *freelist[KILO_SLAB_CLASSES];
+  // Blocks too large for the size classes.
+  struct largeblock *large;
+  // Statistics, shown by the :mem command.
+  size_t chunkbytes;
+  size_t livebytes;
+  size_t freebytes;
+  size_t largebytes;
+  size_t allocs;
+  size_t frees;
+};
+
+/*
+ * A buffer opened from a file of at least E.scratchmin bytes (see
+ * --scratch) keeps its row metadata (the arrays of its leaves) and the
+ * chunks of its row arena in a scratch file instead of anonymous memory.
+ * The file is mapped shared, a region at a time, so the kernel pages it like
+ * any other file: pages that weren't used lately are written out to it and
+ * dropped when memory runs low, and read back in when they are touched
+ * again. Rows still mapped from the file being edited are re-read from that
+ * file the same way, so a buffer can grow well past the size of RAM without
+ * the OOM killer stepping in.
+ * The scratch file is created next to the file being edited, on the
+ * assumption that a file system with room for the file has room for its
+ * metadata, and is unlinked right away so that it never outlives the
+ * editor. Only a few sizes of block are allocated from it (see enum
+ * scratchClass), and freed blocks are recycled through one free list per
+ * size.
+ */
+#define KILO_SCRATCH_REGION (64 << 20)
+#define KILO_SCRATCH_MIN ((size_t)256 << 20)
+
+// The sizes of the blocks in a scratch file: the arrays of a leaf (which
+// always has room for KILO_LEAF_ROWS rows there), its saved hashes, and the
+// chunks of the row arena.
+enum scratchClass {
+  SCRATCH_LEAF_ROWS = 0,
+  SCRATCH_LEAF_HASHES,
+  SCRATCH_ARENA_CHUNK,
+  SCRATCH_CLASSES
+};
+
+struct scratchfile {
+  // The scratch file, or -1 when the buffer is kept in memory, and the number
+  // of bytes of it given to regions so far.
+  int fd;
+  off_t size;
+  // Mapped regions, sorted by address, and the bump pointer into the newest
+  // one with the bytes left after it.
+  char **regions;
+  int nregions;
+  char *bump;
+  size_t bumpleft;
+  // Free blocks of each enum scratchClass, linked through their first bytes.
+  void *freelist[SCRATCH_CLASSES];
+  // Threads loading a file in the background allocate leaves as well.
+  pthread_mutex_t lock;
+};
+
+/*
+ * Storage for the text of rows read from files that can't be mapped, where
+ * each distinct line is kept once (interned): rows with the same text point
+ * at the same string, the way mapped rows point into the file. Logs and
+ * other repetitive files then cost one copy per distinct line instead of one
+ * per row. The strings are \0-terminated, packed into chunks, and live until
+ * the buffer is closed. The hash table that finds them is only kept while a
+ * file is being read.
+ */
+#define KILO_INTERN_CHUNK (1 << 16)
+
+struct internstr {
+  uint64_t hash;
+  char *s;
+  size_t len;
+};
+
+struct internpool {
+  char **chunks;
+  int nchunks;
+  int chunkcap;
+  // Bump pointer into the newest chunk and the bytes left after it.
+  char *bump;
+  size_t bumpleft;
+  // Open addressing hash table, with a power of two number of slots.
+  struct internstr *table;
+  size_t tablecap;
+  size_t count;
+};
+
+/*
+ * An immutable view of the buffer's rows as they were when it was taken,
+ * which another thread can read while the buffer keeps being edited.
+ * Taking a snapshot is O(1): it shares the live row tree, bumping the root's
+ * refs. From then on the live tree copies any shared node before changing it
+ * (editorNodeWritable, which copies the path down from the root), and rows
+ * in copied leaves are marked ROW_SHARED so their text is copied before it
+ * is edited. Readers only look at the leaves' chars and size arrays.
+ * Snapshots are taken and released on the main thread.
+ */
+struct snapshot {
+  struct rownode *root;
+  size_t numrows;
+  // The file mapping the mapped rows point into, which is kept until the
+  // snapshot is released: maplen bytes of file, in mapsize bytes of mapping.
+  char *map;
+  size_t maplen;
+  size_t mapsize;
+};
+
+/*
+ * A row block (or, with map set, a file mapping) that a snapshot may still
+ * be reading, waiting to be freed.
+ */
+struct deferredfree {
+  char *ptr;
+  size_t len;
+  int map;
+};
+
 /*
  * Store the different modes for the editor
  */
@@ -120,16 +489,99 @@ enum modes { MODE_NORMAL = 0, MODE_INSERT, MODE_COMMAND };
 
 struct editorConfig {
   enum modes mode;
-  int cx;
-  int cy;
-  int rx;
-  int rowoff;
-  int coloff;
+  // Byte and rendered column positions are size_t, like the row lengths
+  // they index into, so that lines longer than INT_MAX work. So are row
+  // numbers and counts, for files with more than INT_MAX lines.
+  size_t cx;
+  size_t cy;
+  size_t rx;
+  size_t rowoff;
+  size_t coloff;
   int screenrows;
   int screencols;
-  int numrows;
-  erow *row;
+  size_t numrows;
+  // The root of the row tree.
+  struct rownode *rowroot;
+  // Cache of the most recently looked up leaf and its first row number,
+  // which makes sequential access (drawing, searching, saving) cheap.
+  struct rownode *leafhint;
+  size_t leafhint_at;
+  // The row currently holding an open gap buffer, if any.
+  erow *gaprow;
+  // The allocator that owns the memory of the buffer's rows.
+  struct rowarena arena;
+  // The scratch file holding the buffer's row metadata and arena, if any,
+  // and the size from which files get one, set with --scratch.
+  struct scratchfile scratch;
+  size_t scratchmin;
+  // The text of rows marked ROW_INTERNED.
+  struct internpool intern;
+  // Every row above this one has an up to date ROW_HL_OPEN_COMMENT, which is
+  // what highlighting the next row depends on.
+  size_t hlvalid;
+  // The search match shown on top of the highlighting, if hlmatch_row >= 0.
+  ptrdiff_t hlmatch_row;
+  size_t hlmatch_rx;
+  size_t hlmatch_len;
+  // The read only mapping of the file that rows marked ROW_MAPPED point
+  // into (see editorOpen and editorMapRebase): maplen bytes of file, in
+  // mapsize bytes of mapping, of the file with device mapdev and inode
+  // mapino.
+  char *map;
+  size_t maplen;
+  size_t mapsize;
+  dev_t mapdev;
+  ino_t mapino;
+  // The number of times reading the mapping failed because the file was
+  // truncated (see editorMapFault), counted by the signal handler, and the
+  // number of those that were reported.
+  volatile sig_atomic_t mapfaults;
+  int mapfaultsseen;
+  // Whether a mapped file was found truncated, and its device and inode. It
+  // is not saved over unless that is forced, as the text cut off it reads as
+  // \0 bytes.
+  int truncated;
+  dev_t truncdev;
+  ino_t truncino;
+  // Bytes held by the render and hl regions of all rows and by the erows of
+  // rows still mapped from the file, the ceiling set with --mem-limit (0 for
+  // none), and the ends of the list of rows in the order their render and hl
+  // were last used (see editorRowTouch).
+  size_t derivedbytes;
+  size_t memlimit;
+  erow *lruhead;
+  erow *lrutail;
+  // Number of live snapshots, and the memory that had to stay around for
+  // them: row blocks and file mappings to free once the last one is gone.
+  int snapshots;
+  struct deferredfree *deferred;
+  int ndeferred;
+  int deferredcap;
+  // The save running in the background, if any (see editorSave), and the
+  // size from which files are saved in place instead, set with
+  // --save-in-place (SIZE_MAX for never).
+  struct savejob *save;
+  size_t inplacesize;
+  // The rest of the file being loaded in the background, if any (see
+  // struct loadjob).
+  struct loadjob *load;
+  // Number of changes made to the buffer, for telling whether it changed
+  // while it was being saved. Whether the buffer differs from the file is
+  // tracked per row instead (see editorModified).
   int dirty;
+  // Number of rows with ROW_DIRTY, and the number of rows when the file was
+  // opened or saved.
+  size_t dirtyrows;
+  size_t savedrows;
+  // The first row that may have changed, moved or been deleted since then
+  // (SIZE_MAX for none), and the file as it was then, if the buffer's mapped
+  // rows point into it (see editorFileSame).
+  size_t firstdirty;
+  struct stat filest;
+  int filestknown;
+  // The line endings of the file as it was opened (EOL_LF and EOL_CRLF),
+  // which offsets in it depend on (see editorEolExtra). Saving writes \n.
+  int eol;
   char *filename;
   char statusmsg[80];
   time_t statusmsg_time;
@@ -164,7 +616,27 @@ struct editorSyntax HLDB[] = {
 // allowing them to be used before definition when compiling.
 
 void editorSetStatusMessage(const char *fmt, ...);
+erow *editorRowAt(size_t at);
+size_t editorRowIndex(erow *row);
+struct rownode *editorLeafAt(size_t at, int *off);
+struct rownode *editorFindLeaf(size_t at, int *off);
+struct rownode *editorNodeWritable(struct rownode *node);
+void editorNodeCount(struct rownode *node, size_t rows, size_t bytes);
+struct rownode *editorLeafNext(struct rownode *leaf);
+size_t editorCapacity(size_t cap, size_t need);
+void editorNodeFree(struct rownode *node);
+void editorLeafHashes(struct rownode *leaf);
+void editorLruUnlink(erow *row);
+uint64_t editorHashBytes(const char *p, size_t len);
+void editorInvalidateHighlight(void);
+void editorLeafFreeArrays(struct rownode *node);
+void editorGapFlush(void);
 void editorRefreshScreen(void);
+void editorSaveFinish(void);
+void editorSavePoll(void);
+void editorSaveMapping(char **map, size_t *size);
+void editorLoadPoll(void);
+void editorLoadWait(void);
 char *editorPrompt(char *prompt, void (*callback)(char *, int));
 
 /*** terminal ***/
@@ -275,6 +747,11 @@ int editorReadKey(void) {
     if (nread == -1 && errno != EAGAIN) {
       die("read");
     }
+    // Finish a background save or load while there is nothing else to do.
+    if (nread == 0) {
+      editorSavePoll();
+      editorLoadPoll();
+    }
   }
 
   // If we read an <esc>, immediately read the next two bytes.
@@ -429,32 +906,33 @@ int is_separator(int c) {
 }
 /*
  * Categorize the contents of a given row into syntax categories
- * for highlighting.
+ * for highlighting, given whether the previous row ended inside a multiline
+ * comment. One category per rendered character is written to hl, which must
+ * hold at least rsize bytes. The row must already be rendered.
+ * Returns whether the row ends inside a multiline comment.
  */
-void editorUpdateSyntax(erow *row) {
-  // Allocate enough memory in hl to store the current row
-  row->hl = realloc(row->hl, row->rsize);
+int editorUpdateSyntax(erow *row, unsigned char *hl, int prev_open_comment) {
   // copy the default highlighting category into the each memory
   // block for the row.
-  memset(row->hl, HL_NORMAL, row->rsize);
+  memset(hl, HL_NORMAL, row->rsize);
 
   // Quit out if no syntax is defined.
   if (E.syntax == NULL)
-    return;
+    return 0;
 
   // Store all keywords to highlight from the current language config.
   char **keywords = E.syntax->keywords;
 
   // Store the comment prefix to look for from the current language config.
   char *scs = E.syntax->singleline_comment_start;
-  int scs_len = scs ? strlen(scs) : 0;
+  size_t scs_len = scs ? strlen(scs) : 0;
 
   // Store the multiline-comment prefix and end chars
   char *mcs = E.syntax->multiline_comment_start;
   char *mce = E.syntax->multiline_comment_end;
 
-  int mcs_len = mcs ? strlen(mcs) : 0;
-  int mce_len = mce ? strlen(mce) : 0;
+  size_t mcs_len = mcs ? strlen(mcs) : 0;
+  size_t mce_len = mce ? strlen(mce) : 0;
 
   // Store whether the preceding character for a given string is a separator.
   int prev_sep = 1;
@@ -463,14 +941,14 @@ void editorUpdateSyntax(erow *row) {
   int in_string = 0;
 
   // Store whether the character is currently inside of a multiline comment.
-  int in_comment = (row->idx > 0 && E.row[row->idx - 1].hl_open_comment);
+  int in_comment = prev_open_comment;
 
   // Iterate through the rendered characters in the row.
   // Using a while loop to allow for checking multiple characters at once.
-  int i = 0;
+  size_t i = 0;
   while (i < row->rsize) {
     char c = row->render[i];
-    unsigned char prev_hl = (i > 0) ? row->hl[i - 1] : HL_NORMAL;
+    unsigned char prev_hl = (i > 0) ? hl[i - 1] : HL_NORMAL;
 
     // Highlight singleline comments
     // ...as long as the start string is defined, and we're not already
@@ -479,7 +957,7 @@ void editorUpdateSyntax(erow *row) {
       // If the next scs_len characters of row.render match the scs string:
       if (!strncmp(&row->render[i], scs, scs_len)) {
         // Set the entire single comment row length from i-> to HL_COMMENT
-        memset(&row->hl[i], HL_COMMENT, row->rsize - i);
+        memset(&hl[i], HL_COMMENT, row->rsize - i);
         break;
       }
     }
@@ -490,12 +968,12 @@ void editorUpdateSyntax(erow *row) {
     if (mcs_len && mce_len && !in_string) {
       if (in_comment) {
         // If we're already in a comment, highlight the current character.
-        row->hl[i] = HL_MLCOMMENT;
+        hl[i] = HL_MLCOMMENT;
         if (!strncmp(&row->render[i], mce, mce_len)) {
           // If the next mce_len characters are the end of an ML comment,
           // highlight them too, and skip forward mce_len chars, and declare
           // that we're no longer in a comment.
-          memset(&row->hl[i], HL_MLCOMMENT, mce_len);
+          memset(&hl[i], HL_MLCOMMENT, mce_len);
           i += mce_len;
           in_comment = 0;
           prev_sep = 1;
@@ -508,7 +986,7 @@ void editorUpdateSyntax(erow *row) {
         // If the next mcs_len characters are the start of a comment,
         // highlight them, jump over them, and declare that we are now in a
         // comment.
-        memset(&row->hl[i], HL_MLCOMMENT, mcs_len);
+        memset(&hl[i], HL_MLCOMMENT, mcs_len);
         i += mcs_len;
         in_comment = 1;
         continue;
@@ -520,11 +998,11 @@ void editorUpdateSyntax(erow *row) {
       if (in_string) {
         // If we're already in a string, just keep highlighting.
         // Set the HL for the current character to HL_STRING.
-        row->hl[i] = HL_STRING;
+        hl[i] = HL_STRING;
         // Account for escaped quotes, which should not end the string.
         if (c == '\\' && i + 1 < row->rsize) {
           // Set the next char to HL_STRING
-          row->hl[i + 1] = HL_STRING;
+          hl[i + 1] = HL_STRING;
           // Skip over the next char, we already handled it.
           i += 2;
           continue;
@@ -541,7 +1019,7 @@ void editorUpdateSyntax(erow *row) {
         // If we hit a closing quotation mark, stop highlighting after this one
         if (c == '"' || c == '\'') {
           in_string = c;
-          row->hl[i] = HL_STRING;
+          hl[i] = HL_STRING;
           i++;
           continue;
         }
@@ -555,7 +1033,7 @@ void editorUpdateSyntax(erow *row) {
       if ((isdigit(c) && (prev_sep || prev_hl == HL_NUMBER)) ||
           (c == '.' && prev_hl == HL_NUMBER)) {
         // Assign HL_NUMBER to the character.
-        row->hl[i] = HL_NUMBER;
+        hl[i] = HL_NUMBER;
         i++;
         // Mark that the previous character was not a separator (because it was
         // a digit).
@@ -570,7 +1048,7 @@ void editorUpdateSyntax(erow *row) {
       int j;
       for (j = 0; keywords[j]; j++) {
         // Store the length of a given keyword.
-        int klen = strlen(keywords[j]);
+        size_t klen = strlen(keywords[j]);
         // check if the last character is a '|', which denotes that it is
         // a Keyword2. Otherwise, it's a Keyword1.
         int is_kw2 = keywords[j][klen - 1] == '|';
@@ -583,7 +1061,7 @@ void editorUpdateSyntax(erow *row) {
         if (!strncmp(&row->render[i], keywords[j], klen) &&
             is_separator(row->render[i + klen])) {
           // Set the next klen chars to HL_KW1/KW2
-          memset(&row->hl[i], is_kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
+          memset(&hl[i], is_kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
           // Jump forward to the end of the keyword.
           i += klen;
           break;
@@ -600,14 +1078,10 @@ void editorUpdateSyntax(erow *row) {
     i++;
   }
 
-  // Check if the multiline comment status changed on this row.
-  int changed = (row->hl_open_comment != in_comment);
-  row->hl_open_comment = in_comment;
-  // If it did, and there is a row after this one, call update syntax on it
-  // recursively until one of them is unchanged.
-  if (changed && row->idx + 1 < E.numrows) {
-    editorUpdateSyntax(&row[row->idx + 1]);
-  }
+  // Return whether the row ends inside a multiline comment. If this changed,
+  // the next row will notice that its recorded state no longer matches when
+  // it is next highlighted (see editorRowHighlight).
+  return in_comment;
 }
 
 /*
@@ -676,11 +1150,9 @@ void editorSelectSyntaxHighlight(void) {
         // Set the syntax rules.
         E.syntax = s;
 
-        // Rehighlight the entire file after setting E.syntax.
-        int filerow;
-        for (filerow = 0; filerow < E.numrows; filerow++) {
-          editorUpdateSyntax(&E.row[filerow]);
-        }
+        // Throw away the highlighting of the entire file after setting
+        // E.syntax. Rows are rehighlighted as they are displayed.
+        editorInvalidateHighlight();
         return;
       }
       i++;
@@ -688,364 +1160,3157 @@ void editorSelectSyntaxHighlight(void) {
   }
 }
 
-/*** row operations ***/
+/*** scratch file ***/
 
 /*
- * Calculate the correct Render Cursor x offset
+ * Start keeping the buffer's row metadata in a scratch file, created next to
+ * filename (see struct scratchfile).
+ * Returns 0 on success and -1 on error, with errno set, in which case the
+ * buffer stays in memory.
  */
-int editorRowCxToRx(erow *row, int cx) {
-  int rx = 0;
-  // Offset
-  rx += KILO_ROW_NUMBER_DIGITS;
-  rx += 1;
-  int j;
-  for (j = 0; j < cx; j++) {
-    // Offset X position by tab stop
-    // If it’s a tab, we use (rx % KILO_TAB_STOP) to find out how many columns
-    // we are to the right of the last tab stop,
-    // then subtract that from (KILO_TAB_STOP - 1) to find out how many
-    // columns we are to the left of the next tab stop.
-    if (row->chars[j] == '\t')
-      rx += (KILO_TAB_STOP - 1) - (rx % KILO_TAB_STOP);
+int editorScratchOpen(const char *filename) {
+  size_t pathlen = strlen(filename) + sizeof(".kilo-scratch-XXXXXX");
+  char *path = malloc(pathlen);
+  snprintf(path, pathlen, "%s.kilo-scratch-XXXXXX", filename);
+  int fd = mkstemp(path);
+  if (fd != -1)
+    unlink(path);
+  free(path);
+  if (fd == -1)
+    return -1;
+  E.scratch.fd = fd;
+  return 0;
+}
 
-    // Regardless, add 1 to rx because we've iterated forward 1 character
-    rx++;
+/*
+ * Return the enum scratchClass of a block of size bytes. Other sizes can't
+ * be allocated from a scratch file.
+ */
+int editorScratchClass(size_t size) {
+  if (size == KILO_LEAF_ROW_BYTES * KILO_LEAF_ROWS)
+    return SCRATCH_LEAF_ROWS;
+  if (size == KILO_LEAF_HASH_BYTES * KILO_LEAF_ROWS)
+    return SCRATCH_LEAF_HASHES;
+  assert(size == KILO_ARENA_CHUNK);
+  return SCRATCH_ARENA_CHUNK;
+}
+
+/*
+ * Return whether p points into one of the scratch file's regions, rather
+ * than at a block that was malloc'd before the file was opened.
+ */
+int editorScratchOwns(struct scratchfile *s, void *p) {
+  uintptr_t addr = (uintptr_t)p;
+  int lo = 0, hi = s->nregions;
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    uintptr_t region = (uintptr_t)s->regions[mid];
+    if (addr < region)
+      hi = mid;
+    else if (addr >= region + KILO_SCRATCH_REGION)
+      lo = mid + 1;
+    else
+      return 1;
   }
-  return rx;
+  return 0;
 }
 
 /*
- * Calculate the correct render offset for a given cursor position
+ * Allocate size bytes (one of the sizes of enum scratchClass) from the
+ * scratch file, or with malloc() when the buffer doesn't have one.
  */
-int editorRowRxToCx(erow *row, int rx) {
-  int cur_rx = 0;
-  // Iterate through every character in the row looking for tabs
-  // because tabs take up more render space than byte space.
-  int cx;
-  for (cx = 0; cx < row->size; cx++) {
-    if (row->chars[cx] == '\t') {
-      // If we find a tab, offset the cur_rx by the appropriate amount.
-      cur_rx = (KILO_TAB_STOP - 1) - (cur_rx % KILO_TAB_STOP);
+void *editorScratchAlloc(size_t size) {
+  struct scratchfile *s = &E.scratch;
+  if (s->fd == -1)
+    return malloc(size);
+
+  int cls = editorScratchClass(size);
+  pthread_mutex_lock(&s->lock);
+  void *p = s->freelist[cls];
+  if (p) {
+    // Reuse a freed block of this size.
+    memcpy(&s->freelist[cls], p, sizeof(void *));
+  } else {
+    if (s->bumpleft < size) {
+      // The disk space for a region is reserved up front, as running out of
+      // it while the kernel writes back a page would kill the editor with
+      // SIGBUS. Without the space, the region is kept in memory instead.
+      char *region = MAP_FAILED;
+      if (posix_fallocate(s->fd, s->size, KILO_SCRATCH_REGION) == 0) {
+        region = mmap(NULL, KILO_SCRATCH_REGION, PROT_READ | PROT_WRITE,
+                      MAP_SHARED, s->fd, s->size);
+        if (region != MAP_FAILED)
+          s->size += KILO_SCRATCH_REGION;
+      }
+      if (region == MAP_FAILED)
+        region = mmap(NULL, KILO_SCRATCH_REGION, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (region == MAP_FAILED)
+        die("mmap");
+      // Keep the regions sorted, for editorScratchOwns.
+      s->regions = realloc(s->regions, sizeof(char *) * (s->nregions + 1));
+      int i = s->nregions++;
+      for (; i > 0 && (uintptr_t)s->regions[i - 1] > (uintptr_t)region; i--)
+        s->regions[i] = s->regions[i - 1];
+      s->regions[i] = region;
+      s->bump = region;
+      s->bumpleft = KILO_SCRATCH_REGION;
     }
-    // Either way, move it forward by 1 char.
-    cur_rx++;
-
-    // If we've passed the render X we're looking from, we're done.
-    if (cur_rx > rx)
-      return cx;
+    p = s->bump;
+    s->bump += size;
+    s->bumpleft -= size;
   }
-
-  // This is a safety fallback in case the provided rx is out of range.
-  return cx;
+  pthread_mutex_unlock(&s->lock);
+  return p;
 }
 
 /*
- * Convert a buffered text row into a rendered row for display.
+ * Free a block of size bytes allocated with editorScratchAlloc, or with
+ * malloc() before the buffer's scratch file was opened.
  */
-void editorUpdateRow(erow *row) {
-  // Count the number of tab characters in the row in order to alloc enough
-  // memory.
-  int tabs = 0;
-  int j;
-  for (j = 0; j < row->size; j++) {
-    if (row->chars[j] == '\t')
-      tabs++;
+void editorScratchFree(void *p, size_t size) {
+  struct scratchfile *s = &E.scratch;
+  if (p == NULL)
+    return;
+  if (s->fd == -1) {
+    free(p);
+    return;
   }
 
-  // Free up space and allocate it to hold the row, accounting for \t now
-  // taking up 8 space characters instead.
-  free(row->render);
-  row->render = malloc(row->size + (tabs * (KILO_TAB_STOP - 1)) + 1);
-
-  // Copy over each char from row into render.
-  int idx = 0;
-  for (j = 0; j < row->size; j++) {
-    if (row->chars[j] == '\t') {
-      // If the char is a tab, loop to replace it with 8 spaces.
-      row->render[idx++] = ' ';
-      while (idx % KILO_TAB_STOP != 0)
-        row->render[idx++] = ' ';
-    } else {
-      // Otherwise copy it over as-is.
-      row->render[idx++] = row->chars[j];
-    }
+  pthread_mutex_lock(&s->lock);
+  int owned = editorScratchOwns(s, p);
+  if (owned) {
+    int cls = editorScratchClass(size);
+    memcpy(p, &s->freelist[cls], sizeof(void *));
+    s->freelist[cls] = p;
   }
-
-  // Denote the end of the line
-  row->render[idx] = '\0';
-  // After the above for-loop, idx contains the number of chars that were
-  // copied over and can be used to describe the render size
-  row->rsize = idx;
-
-  // Refresh the syntax highlighting assignments for this row.
-  editorUpdateSyntax(row);
+  pthread_mutex_unlock(&s->lock);
+  if (!owned)
+    free(p);
 }
 
 /*
- * Add a row as a string with length len as a new row in the editor at a given
- * position, 'at'.
+ * Unmap and close the scratch file, if the buffer has one, once nothing is
+ * allocated from it any more.
  */
-void editorInsertRow(int at, char *s, size_t len) {
-  if (at < 0 || at > E.numrows)
+void editorScratchRelease(void) {
+  struct scratchfile *s = &E.scratch;
+  if (s->fd == -1)
     return;
+  for (int i = 0; i < s->nregions; i++)
+    munmap(s->regions[i], KILO_SCRATCH_REGION);
+  free(s->regions);
+  close(s->fd);
+  s->fd = -1;
+  s->size = 0;
+  s->regions = NULL;
+  s->nregions = 0;
+  s->bump = NULL;
+  s->bumpleft = 0;
+  memset(s->freelist, 0, sizeof(s->freelist));
+}
 
-  // Allocate space for a new erow.
-  E.row = realloc(E.row, (sizeof(erow)) * (E.numrows + 1));
-  // Make room at the specified index for the new row
-  memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * (E.numrows - at));
+/*** row allocator ***/
+
+/*
+ * Return the smallest size class that can hold size bytes.
+ */
+int editorSlabClass(size_t size) {
+  int c = 0;
+  while ((size_t)(KILO_SLAB_MIN << c) < size)
+    c++;
+  return c;
+}
 
-  // Adjust the index of all following rows whenever a row is added.
-  for (int j = at + 1; j <= E.numrows; j++) {
-    E.row[j].idx++;
+/*
+ * Bump allocate size bytes from the newest arena chunk, starting a new chunk
+ * when the current one is used up.
+ */
+char *editorArenaBump(size_t size) {
+  struct rowarena *a = &E.arena;
+  if (a->bumpleft < size) {
+    a->chunks = realloc(a->chunks, sizeof(char *) * (a->nchunks + 1));
+    a->bump = a->chunks[a->nchunks++] = editorScratchAlloc(KILO_ARENA_CHUNK);
+    a->bumpleft = KILO_ARENA_CHUNK;
+    a->chunkbytes += KILO_ARENA_CHUNK;
   }
+  char *block = a->bump;
+  a->bump += size;
+  a->bumpleft -= size;
+  return block;
+}
 
-  // Store the row's index so it always knows where it is (and where its
-  // neighbors are).
-  E.row[at].idx = at;
+/*
+ * Allocate a block for a row that can hold at least size bytes, and store
+ * the number of bytes it actually holds in *bsize.
+ * exact is used for rows that are likely never to grow (rows being loaded),
+ * and packs them tightly. Otherwise the block gets a full size class so it
+ * can be recycled for other rows once it is freed.
+ */
+char *editorBlockAlloc(size_t size, int exact, size_t *bsize) {
+  struct rowarena *a = &E.arena;
+  char *block;
+  a->allocs++;
+
+  if (size > KILO_SLAB_MAX) {
+    // Large blocks get their own allocation, with a header linking them in.
+    struct largeblock *lb = malloc(sizeof(struct largeblock) + size);
+    lb->prev = NULL;
+    lb->next = a->large;
+    if (a->large)
+      a->large->prev = lb;
+    a->large = lb;
+    lb->size = size;
+    a->largebytes += size;
+    *bsize = size;
+    return (char *)(lb + 1);
+  }
 
-  // Define the length of the row to add and store a pointer to
-  // the next free large enough memory address.
-  E.row[at].size = len;
-  E.row[at].chars = malloc(len + 1);
+  if (exact) {
+    // Round up to keep blocks pointer aligned, and big enough to be put on
+    // a free list later.
+    *bsize = size < KILO_SLAB_MIN ? KILO_SLAB_MIN : (size + 7) & ~(size_t)7;
+    block = editorArenaBump(*bsize);
+  } else {
+    int c = editorSlabClass(size);
+    *bsize = KILO_SLAB_MIN << c;
+    if (a->freelist[c]) {
+      // Reuse a freed block of this class.
+      block = a->freelist[c];
+      memcpy(&a->freelist[c], block, sizeof(void *));
+      a->freebytes -= *bsize;
+    } else {
+      block = editorArenaBump(*bsize);
+    }
+  }
+  a->livebytes += *bsize;
+  return block;
+}
 
-  // copy the len bytes from memory address s to the memory addresses starting
-  // with the start-point of the new row.
-  memcpy(E.row[at].chars, s, len);
-  E.row[at].chars[len] = '\0';
+/*
+ * Give a block of bsize bytes back to the arena.
+ */
+void editorBlockFree(char *block, size_t bsize) {
+  struct rowarena *a = &E.arena;
+  if (block == NULL)
+    return;
+  a->frees++;
+
+  if (bsize > KILO_SLAB_MAX) {
+    struct largeblock *lb = (struct largeblock *)block - 1;
+    if (lb->prev)
+      lb->prev->next = lb->next;
+    else
+      a->large = lb->next;
+    if (lb->next)
+      lb->next->prev = lb->prev;
+    a->largebytes -= lb->size;
+    free(lb);
+    return;
+  }
 
-  // Define the size of the text to render and a NULL pointer for rendering
-  // and highlighting;
-  E.row[at].rsize = 0;
-  E.row[at].render = NULL;
-  E.row[at].hl = NULL;
-  E.row[at].hl_open_comment = 0;
+  // File the block under the largest size class it can hold. Blocks from
+  // the load arena aren't sized to a class, so round those down.
+  int c = editorSlabClass(bsize);
+  if ((size_t)(KILO_SLAB_MIN << c) > bsize)
+    c--;
+  memcpy(block, &a->freelist[c], sizeof(void *));
+  a->freelist[c] = block;
+  a->livebytes -= bsize;
+  a->freebytes += KILO_SLAB_MIN << c;
+}
 
-  // pass the mem address of the current row's start position.
-  editorUpdateRow(&E.row[at]);
+/*
+ * Release all of the memory held by the arena at once, no matter how many
+ * rows were allocated from it.
+ */
+void editorArenaRelease(void) {
+  struct rowarena *a = &E.arena;
+  for (int i = 0; i < a->nchunks; i++)
+    editorScratchFree(a->chunks[i], KILO_ARENA_CHUNK);
+  free(a->chunks);
+  while (a->large) {
+    struct largeblock *next = a->large->next;
+    free(a->large);
+    a->large = next;
+  }
+  memset(a, 0, sizeof(*a));
+}
 
-  // Let the editor know how long the rows array is.
-  E.numrows++;
-  E.dirty++;
+/*
+ * Show the arena's statistics in the status bar.
+ */
+void editorArenaStats(void) {
+  struct rowarena *a = &E.arena;
+  editorSetStatusMessage("rows: %zuK in %d chunks, %zuK free, %zuK large, "
+                         "%zu allocs, %zu frees",
+                         a->livebytes / 1024, a->nchunks, a->freebytes / 1024,
+                         a->largebytes / 1024, a->allocs, a->frees);
 }
 
 /*
- * Free the raw and rendered char arrays from a given editor row.
+ * Hold on to memory that a snapshot may still be reading (a row block, or a
+ * file mapping when map is set) until the last snapshot is released.
  */
-void editorFreeRow(erow *row) {
-  free(row->render);
-  free(row->chars);
-  free(row->hl);
+void editorDeferFree(char *ptr, size_t len, int map) {
+  if (E.ndeferred == E.deferredcap) {
+    E.deferredcap = editorCapacity(E.deferredcap, E.ndeferred + 1);
+    E.deferred =
+        realloc(E.deferred, sizeof(struct deferredfree) * E.deferredcap);
+  }
+  E.deferred[E.ndeferred].ptr = ptr;
+  E.deferred[E.ndeferred].len = len;
+  E.deferred[E.ndeferred].map = map;
+  E.ndeferred++;
 }
 
 /*
- * Completely delete a single row.
+ * Free everything editorDeferFree held on to, once no snapshots are left.
  */
-void editorDelRow(int at) {
-  if (at < 0 || at >= E.numrows)
-    return;
+void editorDeferredFlush(void) {
+  for (int i = 0; i < E.ndeferred; i++) {
+    struct deferredfree *d = &E.deferred[i];
+    if (d->map)
+      munmap(d->ptr, d->len);
+    else
+      editorBlockFree(d->ptr, d->len);
+  }
+  E.ndeferred = 0;
+}
 
-  // Free the memory owned by the row to delete.
-  editorFreeRow(&E.row[at]);
+/*
+ * Copy len bytes of s into the intern pool, with a \0 byte after them.
+ */
+char *editorInternStore(const char *s, size_t len) {
+  struct internpool *p = &E.intern;
+  char *dst;
+  if (len + 1 > KILO_INTERN_CHUNK / 4 || len + 1 > p->bumpleft) {
+    // Long strings get a chunk of their own, so that they don't waste the
+    // rest of the current one.
+    int own = len + 1 > KILO_INTERN_CHUNK / 4;
+    size_t size = own ? len + 1 : KILO_INTERN_CHUNK;
+    if (p->nchunks == p->chunkcap) {
+      p->chunkcap = editorCapacity(p->chunkcap, p->nchunks + 1);
+      p->chunks = realloc(p->chunks, sizeof(char *) * p->chunkcap);
+    }
+    dst = malloc(size);
+    p->chunks[p->nchunks++] = dst;
+    if (!own) {
+      p->bump = dst + len + 1;
+      p->bumpleft = size - len - 1;
+    }
+  } else {
+    dst = p->bump;
+    p->bump += len + 1;
+    p->bumpleft -= len + 1;
+  }
+  memcpy(dst, s, len);
+  dst[len] = '\0';
+  return dst;
+}
 
-  // Shift all following rows into the memory previously occupied by the row
-  // to delete.
-  memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numrows - at - 1));
+/*
+ * Return the interned copy of the len bytes at s, adding it to the pool if
+ * this is the first time they are seen.
+ */
+char *editorIntern(const char *s, size_t len) {
+  struct internpool *p = &E.intern;
+
+  // Keep the table at most three quarters full, doubling it as it fills.
+  if ((p->count + 1) * 4 > p->tablecap * 3) {
+    size_t cap = p->tablecap ? p->tablecap * 2 : 1024;
+    struct internstr *table = calloc(cap, sizeof(struct internstr));
+    for (size_t i = 0; i < p->tablecap; i++) {
+      if (p->table[i].s == NULL)
+        continue;
+      size_t k = p->table[i].hash & (cap - 1);
+      while (table[k].s)
+        k = (k + 1) & (cap - 1);
+      table[k] = p->table[i];
+    }
+    free(p->table);
+    p->table = table;
+    p->tablecap = cap;
+  }
 
-  // Decrement the index of all following rows when a row is deleted.
-  for (int j = at; j < E.numrows - 1; j++) {
-    E.row[j].idx--;
+  uint64_t hash = editorHashBytes(s, len);
+  size_t k = hash & (p->tablecap - 1);
+  for (; p->table[k].s; k = (k + 1) & (p->tablecap - 1)) {
+    struct internstr *e = &p->table[k];
+    if (e->hash == hash && e->len == len && memcmp(e->s, s, len) == 0)
+      return e->s;
   }
 
-  E.numrows--;
-  E.dirty++;
+  struct internstr *e = &p->table[k];
+  e->hash = hash;
+  e->len = len;
+  e->s = editorInternStore(s, len);
+  p->count++;
+  return e->s;
 }
 
 /*
- * Insert a single character at a given position in an existing row.
- * Note that this function does not need to know the details of the
- * cursor positioning, it only worries about the memory operations required
- * to insert the character.
+ * Drop the intern pool's hash table once a file has been read. The strings
+ * stay.
  */
-void editorRowInsertChar(erow *row, int at, int c) {
-  // Validate 'at', noting that it can be 1 position past the end of the row
-  // in which case it needs to be moved placed at the actual end of the row
-  // row->size.
-  if (at < 0 || at > row->size)
-    at = row->size;
-
-  // Allocate a block with enough memory for the current row + 2,
-  // 1 for the new character and 1 for the null byte.
-  row->chars = realloc(row->chars, row->size + 2);
+void editorInternDone(void) {
+  free(E.intern.table);
+  E.intern.table = NULL;
+  E.intern.tablecap = 0;
+  E.intern.count = 0;
+}
 
-  // memmove is a lot like memcpy but safe to use in cases where the
-  // to and from arrays / memory blocks overlap.
-  memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
+/*
+ * Free the intern pool, along with every string in it.
+ */
+void editorInternRelease(void) {
+  struct internpool *p = &E.intern;
+  for (int i = 0; i < p->nchunks; i++)
+    free(p->chunks[i]);
+  free(p->chunks);
+  free(p->table);
+  memset(p, 0, sizeof(*p));
+}
 
-  // Let the row know its new size.
-  row->size++;
+/*** hashing ***/
 
-  // Insert the new character and persist it to the editor.
-  row->chars[at] = c;
-  editorUpdateRow(row);
+/*
+ * A 64-bit hash of a string that is fed in one or more pieces, for telling
+ * whether text changed. It mixes in eight bytes at a time, so hashing even
+ * very long rows is quick. Not meant to withstand deliberate collisions.
+ */
+struct hasher {
+  uint64_t h;
+  uint64_t len;
+  unsigned char word[8];
+};
 
-  E.dirty++;
+void editorHashInit(struct hasher *hs) {
+  hs->h = 0;
+  hs->len = 0;
 }
 
 /*
- * Append a given string s of length len to a given editor row.
+ * Mix one eight byte word into the hash.
  */
-void editorRowAppendString(erow *row, char *s, size_t len) {
-  // Increase the memory size of the given row to account for the length of the
-  // new string, plus 1 more for the EOL null byte.
-  row->chars = realloc(row->chars, row->size + len + 1);
+uint64_t editorHashMix(uint64_t h, uint64_t w) {
+  h = (h ^ w) * 0x9e3779b97f4a7c15ULL;
+  return h ^ (h >> 32);
+}
 
-  // Copy the contents of s to the end of the row's chars array.
-  memcpy(&row->chars[row->size], s, len);
+void editorHashUpdate(struct hasher *hs, const char *p, size_t len) {
+  size_t have = hs->len % 8;
+  hs->len += len;
+
+  // Complete a word left partially filled by the previous piece.
+  if (have > 0) {
+    size_t n = len < 8 - have ? len : 8 - have;
+    memcpy(&hs->word[have], p, n);
+    p += n;
+    len -= n;
+    if (have + n < 8)
+      return;
+    uint64_t w;
+    memcpy(&w, hs->word, 8);
+    hs->h = editorHashMix(hs->h, w);
+  }
 
-  // Update the stored row size.
-  row->size += len;
+  for (; len >= 8; p += 8, len -= 8) {
+    uint64_t w;
+    memcpy(&w, p, 8);
+    hs->h = editorHashMix(hs->h, w);
+  }
+  memcpy(hs->word, p, len);
+}
 
-  // Add the EOL null byte.
-  row->chars[row->size] = '\0';
+uint64_t editorHashFinal(struct hasher *hs) {
+  // Pad out the last partial word and mix in the length, so that strings
+  // differing only in trailing zero bytes hash differently.
+  size_t have = hs->len % 8;
+  uint64_t h = hs->h;
+  if (have > 0) {
+    uint64_t w = 0;
+    memset(&hs->word[have], 0, 8 - have);
+    memcpy(&w, hs->word, 8);
+    h = editorHashMix(h, w);
+  }
+  h = editorHashMix(h, hs->len);
+  // Spread every bit of the state over the result.
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  return h;
+}
 
-  // Persist the change to the editor row.
-  editorUpdateRow(row);
-  E.dirty++;
+/*
+ * Hash a string of len bytes.
+ */
+uint64_t editorHashBytes(const char *p, size_t len) {
+  struct hasher hs;
+  editorHashInit(&hs);
+  editorHashUpdate(&hs, p, len);
+  return editorHashFinal(&hs);
 }
 
 /*
- * Delete a single character at a given position in an existing row.
+ * Combine the hash of a row into the hash of the rows before it, giving the
+ * hash of a whole buffer or file (see editorBufferHash).
  */
-void editorRowDelChar(erow *row, int at) {
-  // Validate 'at', noting that if its at an invalid position we can return.
-  if (at < 0 || at > row->size)
-    return;
+uint64_t editorHashCombine(uint64_t h, uint64_t rowhash) {
+  return editorHashMix(h + 1, rowhash);
+}
 
-  // Move the entire memory block down, including the \0 bit at the end.
-  memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
+/*** row operations ***/
 
-  // Decrement the row size and persist the change to the editor.
-  row->size--;
-  editorUpdateRow(row);
+/*
+ * Return the number of bytes an erow takes up in the arena.
+ */
+size_t editorRowBytes(void) {
+  return (size_t)KILO_SLAB_MIN << editorSlabClass(sizeof(erow));
+}
 
-  E.dirty++;
+/*
+ * Return the erow of row j of a leaf, giving the row one first if it doesn't
+ * have one yet. The erow of a row read from the file only holds derived
+ * data, so it is counted in E.derivedbytes, and goes again once that data
+ * is evicted.
+ */
+erow *editorLeafRow(struct rownode *leaf, int j) {
+  if (leaf->erows == NULL)
+    leaf->erows = calloc(leaf->cap, sizeof(erow *));
+  erow *row = leaf->erows[j];
+  if (row)
+    return row;
+
+  size_t bsize;
+  row = (erow *)editorBlockAlloc(sizeof(erow), 0, &bsize);
+  memset(row, 0, sizeof(erow));
+  row->leaf = leaf;
+  row->idx = j;
+  row->gap = leaf->size[j];
+  leaf->erows[j] = row;
+  if (leaf->flags[j] & ROW_MAPPED)
+    E.derivedbytes += bsize;
+  return row;
 }
 
-/*** editor operations ***/
+/*
+ * Free the erow of a row, once its block has been given back.
+ */
+void editorRowDrop(erow *row) {
+  if (ROW_FLAGS(row) & ROW_MAPPED)
+    E.derivedbytes -= editorRowBytes();
+  editorLruUnlink(row);
+  row->leaf->erows[row->idx] = NULL;
+  editorBlockFree((char *)row, editorRowBytes());
+}
 
 /*
- * Manage the cursor aspect of new character insertion.
- * Note that this function does not need to know about the memory implications
- * of inserting a new character, it only manages the cursor positioning.
+ * Return whether a row's block may still be read through a snapshot: the
+ * row's chars are in the block, and the row's leaf was copied away from a
+ * snapshot (ROW_SHARED) or is still shared with one.
  */
-void editorInsertChar(int c) {
-  if (E.cy == E.numrows) {
-    // If the cursor is one past the end of the file (on the new-line-tilde)
-    // add a new empty row before inserting the character
+int editorRowShared(erow *row) {
+  if (E.snapshots == 0 || (ROW_FLAGS(row) & ROW_MAPPED))
+    return 0;
+  if (row->flags & ROW_SHARED)
+    return 1;
+  for (struct rownode *node = row->leaf; node; node = node->parent) {
+    if (node->refs > 1)
+      return 1;
+  }
+  return 0;
+}
+
+/*
+ * Point a row at new text. Snapshots sharing the row's leaf keep the text
+ * they had, as the leaf is copied first.
+ */
+void editorRowSetChars(erow *row, char *chars) {
+  editorNodeWritable(row->leaf);
+  ROW_CHARS(row) = chars;
+}
+
+/*
+ * Change the size of a row's text, and the byte counts of the nodes above
+ * it along with it. The row's leaf must be ready to be changed (see
+ * editorRowChanging).
+ */
+void editorRowSetSize(erow *row, size_t size) {
+  editorNodeCount(row->leaf, 0, size - ROW_SIZE(row));
+  ROW_SIZE(row) = size;
+}
+
+/*
+ * Give a row's block back to the arena, or hold on to it while a snapshot
+ * may be reading it.
+ */
+void editorRowReleaseBlock(erow *row) {
+  if (editorRowShared(row))
+    editorDeferFree(row->block, row->bsize, 0);
+  else
+    editorBlockFree(row->block, row->bsize);
+}
+
+/*
+ * Return the capacity a buffer that currently has room for cap items should
+ * have in order to hold need items.
+ * A buffer's first allocation is exact, since most rows are never edited.
+ * After that, capacities double so that repeated growth costs amortized O(1)
+ * per item, and they shrink again once the buffer is less than a quarter full.
+ */
+size_t editorCapacity(size_t cap, size_t need) {
+  if (cap == 0)
+    return need;
+  if (need <= cap && need > cap / 4)
+    return cap;
+
+  size_t newcap = KILO_MIN_CAPACITY;
+  while (newcap < need)
+    newcap *= 2;
+  return newcap;
+}
+
+/*
+ * Resize a row's allocation to hold cap bytes of chars, rcap bytes of render
+ * and hlcap bytes of hl, and point the three arrays into it. When alias is
+ * set the render region is left out and render points at chars instead.
+ * The chars are always kept. render is kept when rcap and alias are
+ * unchanged and hl when hlcap is unchanged, otherwise the caller is expected
+ * to rebuild them.
+ */
+void editorRowLayout(erow *row, size_t cap, size_t rcap, size_t hlcap,
+                     int alias) {
+  char *block = row->block;
+  int was_alias = (row->flags & ROW_RENDER_ALIAS) != 0;
+  size_t oldhloff = ROW_HL_OFFSET(row->cap + (was_alias ? 0 : row->rcap));
+  size_t rlen = alias ? 0 : rcap;
+  size_t hloff = ROW_HL_OFFSET(cap + rlen);
+  size_t keeprender = (rcap == row->rcap && alias == was_alias) ? rlen : 0;
+  size_t keephl = (hlcap == row->hlcap) ? hlcap : 0;
+  size_t size = hloff + hlcap;
+  // A block shared with a snapshot can't be changed in place.
+  int shared = editorRowShared(row);
+
+  // Keep count of the memory spent on derived data, for --mem-limit.
+  E.derivedbytes -= (was_alias ? 0 : row->rcap) + row->hlcap;
+  E.derivedbytes += rlen + hlcap;
+
+  if (size == 0) {
+    // Only mapped rows have no chars region, and once their render and hl
+    // are dropped they need no block at all.
+    if (row->block)
+      editorRowReleaseBlock(row);
+    block = NULL;
+    row->bsize = 0;
+  } else if (shared || size > row->bsize || size < row->bsize / 4) {
+    // Move the row to a new block when it has outgrown its current one, or
+    // only uses a small part of it. The first block a row gets is packed
+    // exactly, as most rows are never edited, except under --mem-limit:
+    // evicted blocks are then recycled over and over, which only size
+    // classes allow.
+    size_t bsize;
+    block = editorBlockAlloc(size, row->bsize == 0 && E.memlimit == 0, &bsize);
+    if (row->block) {
+      memcpy(block, row->block, cap < row->cap ? cap : row->cap);
+      memcpy(&block[cap], &row->block[row->cap], keeprender);
+      memcpy(&block[hloff], &row->block[oldhloff], keephl);
+      editorRowReleaseBlock(row);
+    }
+    row->bsize = bsize;
+  } else if (cap < row->cap) {
+    // render and hl move down with the end of the chars region, so move
+    // the lower one first to keep it from being overwritten.
+    memmove(&block[cap], &block[row->cap], keeprender);
+    memmove(&block[hloff], &block[oldhloff], keephl);
+  } else {
+    memmove(&block[hloff], &block[oldhloff], keephl);
+    memmove(&block[cap], &block[row->cap], keeprender);
+  }
+
+  // The text of a row that isn't mapped moves along with its block.
+  if (!(ROW_FLAGS(row) & ROW_MAPPED) && ROW_CHARS(row) != block)
+    editorRowSetChars(row, block);
+  row->block = block;
+  row->flags &= ~ROW_SHARED;
+  row->render = alias ? ROW_CHARS(row) : block ? &block[cap] : NULL;
+  row->hl = block ? (unsigned char *)&block[hloff] : NULL;
+  row->cap = cap;
+  row->rcap = rcap;
+  row->hlcap = hlcap;
+  if (alias)
+    row->flags |= ROW_RENDER_ALIAS;
+  else
+    row->flags &= ~ROW_RENDER_ALIAS;
+}
+
+/*
+ * Give a row that still points into the file mapping, or whose block is
+ * shared with a snapshot, a private copy of its chars, ahead of the row
+ * being edited. The row's leaf must be ready to be changed (see
+ * editorRowChanging).
+ */
+void editorRowOwn(erow *row) {
+  int alias = (row->flags & ROW_RENDER_ALIAS) != 0;
+  if (!(ROW_FLAGS(row) & ROW_MAPPED)) {
+    // Laying out a shared row always moves it to a block of its own.
+    if (editorRowShared(row))
+      editorRowLayout(row, row->cap, row->rcap, row->hlcap, alias);
+    return;
+  }
+
+  // A mapped row's block has no chars region (cap is 0), so laying it out
+  // with one leaves render and hl where they are and makes room in front.
+  // From now on the row's erow holds its text, so it no longer counts as
+  // derived data.
+  char *src = ROW_CHARS(row);
+  size_t size = ROW_SIZE(row);
+  ROW_FLAGS(row) &= ~(ROW_MAPPED | ROW_INTERNED);
+  E.derivedbytes -= editorRowBytes();
+  editorRowLayout(row, size + 1, row->rcap, row->hlcap, alias);
+  memcpy(ROW_CHARS(row), src, size);
+  ROW_CHARS(row)[size] = '\0';
+}
+
+/*
+ * Resize a row's chars region to the capacity needed to hold need bytes.
+ * The caller must make sure the row has no open gap.
+ */
+void editorRowReserve(erow *row, size_t need) {
+  size_t cap = editorCapacity(row->cap, need);
+  if (cap != row->cap)
+    editorRowLayout(row, cap, row->rcap, row->hlcap,
+                    (row->flags & ROW_RENDER_ALIAS) != 0);
+}
+
+/*
+ * Calculate the correct Render Cursor x offset
+ */
+size_t editorRowCxToRx(erow *row, size_t cx) {
+  size_t rx = 0;
+  // Offset
+  rx += KILO_ROW_NUMBER_DIGITS;
+  rx += 1;
+  size_t j;
+  for (j = 0; j < cx; j++) {
+    // Offset X position by tab stop
+    // If it’s a tab, we use (rx % KILO_TAB_STOP) to find out how many columns
+    // we are to the right of the last tab stop,
+    // then subtract that from (KILO_TAB_STOP - 1) to find out how many
+    // columns we are to the left of the next tab stop.
+    if (ROW_CHAR(row, j) == '\t')
+      rx += (KILO_TAB_STOP - 1) - (rx % KILO_TAB_STOP);
+
+    // Regardless, add 1 to rx because we've iterated forward 1 character
+    rx++;
+  }
+  return rx;
+}
+
+/*
+ * Calculate the correct render offset for a given cursor position
+ */
+size_t editorRowRxToCx(erow *row, size_t rx) {
+  size_t cur_rx = 0;
+  // Iterate through every character in the row looking for tabs
+  // because tabs take up more render space than byte space.
+  size_t cx;
+  for (cx = 0; cx < ROW_SIZE(row); cx++) {
+    if (ROW_CHAR(row, cx) == '\t') {
+      // If we find a tab, offset the cur_rx by the appropriate amount.
+      cur_rx = (KILO_TAB_STOP - 1) - (cur_rx % KILO_TAB_STOP);
+    }
+    // Either way, move it forward by 1 char.
+    cur_rx++;
+
+    // If we've passed the render X we're looking from, we're done.
+    if (cur_rx > rx)
+      return cx;
+  }
+
+  // This is a safety fallback in case the provided rx is out of range.
+  return cx;
+}
+
+/*
+ * Convert a buffered text row into a rendered row for display.
+ */
+void editorRenderRow(erow *row) {
+  if (row->flags & ROW_RENDERED)
+    return;
+
+  // Count the number of tab characters in the row in order to alloc enough
+  // memory.
+  size_t size = ROW_SIZE(row);
+  size_t tabs = 0;
+  size_t j;
+  for (j = 0; j < size; j++) {
+    if (ROW_CHAR(row, j) == '\t')
+      tabs++;
+  }
+
+  // Without tabs (and with the row in one piece, no gap) render would be a
+  // byte for byte copy of chars, so let render point at chars and only give
+  // the row room for the \0 byte. Mapped rows have no \0 byte to end render
+  // with, so they always get a copy, unless they are interned and haven't
+  // been shortened.
+  int flags = ROW_FLAGS(row);
+  if (tabs == 0 && row->gaplen == 0 &&
+      (!(flags & ROW_MAPPED) ||
+       ((flags & ROW_INTERNED) && ROW_CHARS(row)[size] == '\0'))) {
+    size_t rcap = editorCapacity(row->rcap, size + 1);
+    if (rcap != row->rcap || !(row->flags & ROW_RENDER_ALIAS))
+      editorRowLayout(row, row->cap, rcap, row->hlcap, 1);
+    row->rsize = size;
+    row->flags |= ROW_RENDERED;
+    return;
+  }
+
+  // Make sure render has room to hold the row, accounting for \t now taking
+  // up 8 space characters instead. It is only reallocated when the row
+  // outgrows it (or shrinks well below it).
+  size_t rcap =
+      editorCapacity(row->rcap, size + (tabs * (KILO_TAB_STOP - 1)) + 1);
+  if (rcap != row->rcap || (row->flags & ROW_RENDER_ALIAS))
+    editorRowLayout(row, row->cap, rcap, row->hlcap, 0);
+
+  // Copy over each char from row into render, reading around the gap so the
+  // row being edited never has to be compacted just to be displayed.
+  size_t idx = 0;
+  for (j = 0; j < size; j++) {
+    char c = ROW_CHAR(row, j);
+    if (c == '\t') {
+      // If the char is a tab, loop to replace it with 8 spaces.
+      row->render[idx++] = ' ';
+      while (idx % KILO_TAB_STOP != 0)
+        row->render[idx++] = ' ';
+    } else {
+      // Otherwise copy it over as-is.
+      row->render[idx++] = c;
+    }
+  }
+
+  // Denote the end of the line
+  row->render[idx] = '\0';
+  // After the above for-loop, idx contains the number of chars that were
+  // copied over and can be used to describe the render size
+  row->rsize = idx;
+  row->flags |= ROW_RENDERED;
+}
+
+/*
+ * Return the highlighting state of a row (ROW_HIGHLIGHTED and friends),
+ * which lives in the row's leaf.
+ */
+unsigned char *editorRowHlState(erow *row) {
+  return &row->leaf->hlstate[row->idx];
+}
+/*
+ * Highlight a rendered row and store the result in its hl region. Short rows
+ * are highlighted in place. Longer ones are highlighted into a scratch buffer
+ * first and then stored as runs, unless the runs would take up more room
+ * than the flat array.
+ */
+void editorRowStoreSyntax(erow *row, int prev_open_comment) {
+  static unsigned char *scratch = NULL;
+  static size_t scratchcap = 0;
+  int alias = (row->flags & ROW_RENDER_ALIAS) != 0;
+  size_t hlcap;
+
+  // Record what the highlighting was worked out from.
+  unsigned char *state = editorRowHlState(row);
+  *state = ROW_HIGHLIGHTED | (prev_open_comment ? ROW_HL_IN_COMMENT : 0);
+
+  if (row->rsize <= KILO_HL_FLAT_MAX) {
+    hlcap = editorCapacity(row->hlcap, row->rsize);
+    if (hlcap != row->hlcap)
+      editorRowLayout(row, row->cap, row->rcap, hlcap, alias);
+    row->flags &= ~ROW_HL_SPANS;
+    if (editorUpdateSyntax(row, row->hl, prev_open_comment))
+      *state |= ROW_HL_OPEN_COMMENT;
+    return;
+  }
+
+  if (scratchcap < row->rsize) {
+    scratchcap = editorCapacity(scratchcap, row->rsize);
+    scratch = realloc(scratch, scratchcap);
+  }
+  if (editorUpdateSyntax(row, scratch, prev_open_comment))
+    *state |= ROW_HL_OPEN_COMMENT;
+
+  // Count the runs of equal categories.
+  size_t n = 1;
+  size_t j;
+  for (j = 1; j < row->rsize; j++) {
+    if (scratch[j] != scratch[j - 1])
+      n++;
+  }
+
+  if (n * sizeof(hlspan) >= row->rsize) {
+    // Too fragmented to be worth it, keep the flat array.
+    hlcap = editorCapacity(row->hlcap, row->rsize);
+    if (hlcap != row->hlcap)
+      editorRowLayout(row, row->cap, row->rcap, hlcap, alias);
+    memcpy(row->hl, scratch, row->rsize);
+    row->flags &= ~ROW_HL_SPANS;
+    return;
+  }
+
+  hlcap = editorCapacity(row->hlcap, n * sizeof(hlspan));
+  if (hlcap != row->hlcap)
+    editorRowLayout(row, row->cap, row->rcap, hlcap, alias);
+  hlspan *spans = (hlspan *)row->hl;
+  size_t start = 0;
+  n = 0;
+  for (j = 1; j <= row->rsize; j++) {
+    if (j == row->rsize || scratch[j] != scratch[start]) {
+      spans[n].start = start;
+      spans[n].len = j - start;
+      spans[n].hl = scratch[start];
+      n++;
+      start = j;
+    }
+  }
+  row->nspans = n;
+  row->flags |= ROW_HL_SPANS;
+}
+
+/*
+ * Return the highlight category of the rendered character rx of the row at
+ * position at, and store in *end where the run of characters sharing that
+ * category ends. The current search match is laid over the highlighting.
+ * The row must be highlighted.
+ */
+int editorRowHlRun(erow *row, size_t at, size_t rx, size_t *end) {
+  int hl;
+  if (row->flags & ROW_HL_SPANS) {
+    // Binary search for the last span starting at or before rx.
+    hlspan *spans = (hlspan *)row->hl;
+    size_t lo = 0, hi = row->nspans - 1;
+    while (lo < hi) {
+      size_t mid = lo + (hi - lo + 1) / 2;
+      if (spans[mid].start <= rx)
+        lo = mid;
+      else
+        hi = mid - 1;
+    }
+    hl = spans[lo].hl;
+    *end = spans[lo].start + spans[lo].len;
+  } else {
+    hl = row->hl[rx];
+    *end = rx + 1;
+    while (*end < row->rsize && row->hl[*end] == hl)
+      (*end)++;
+  }
+
+  if ((ptrdiff_t)at == E.hlmatch_row) {
+    size_t match_end = E.hlmatch_rx + E.hlmatch_len;
+    if (rx >= E.hlmatch_rx && rx < match_end) {
+      hl = HL_MATCH;
+      *end = match_end;
+    } else if (rx < E.hlmatch_rx && *end > E.hlmatch_rx) {
+      *end = E.hlmatch_rx;
+    }
+  }
+  return hl;
+}
+
+
+/*
+ * Drop a row's render and hl, leaving just its chars. They are rebuilt the
+ * next time the row is displayed or searched. The row's ROW_HL_OPEN_COMMENT
+ * is kept, so the rows after it don't need to be rehighlighted. A row read
+ * from the file then needs nothing more than its leaf holds, so it loses
+ * its erow as well.
+ */
+void editorRowEvict(erow *row) {
+  editorRowLayout(row, row->cap, 0, 0, 0);
+  row->flags &= ~(ROW_RENDERED | ROW_HL_SPANS);
+  row->rsize = 0;
+  row->nspans = 0;
+  *editorRowHlState(row) &= ~ROW_HIGHLIGHTED;
+  editorLruUnlink(row);
+  if (ROW_FLAGS(row) & ROW_MAPPED)
+    editorRowDrop(row);
+}
+
+/*
+ * Take a row off the list of recently used rows, if it is on it.
+ */
+void editorLruUnlink(erow *row) {
+  if (row->lruprev)
+    row->lruprev->lrunext = row->lrunext;
+  else if (E.lruhead == row)
+    E.lruhead = row->lrunext;
+  else
+    return;
+  if (row->lrunext)
+    row->lrunext->lruprev = row->lruprev;
+  else
+    E.lrutail = row->lruprev;
+  row->lruprev = NULL;
+  row->lrunext = NULL;
+}
+
+/*
+ * Bring the derived data of the buffer back under E.memlimit by evicting the
+ * least recently used rows first, from the tail of the list. Rows on screen
+ * and keep are left alone; there are only ever a screenful of those to step
+ * over, so this costs O(log n) per evicted row rather than a scan of the
+ * buffer. Evicting down to three quarters of the limit, rather than just
+ * under it, keeps this from running again on the very next row.
+ */
+void editorEvictDerived(erow *keep) {
+  size_t target = E.memlimit / 4 * 3;
+  erow *row = E.lrutail;
+  while (row && E.derivedbytes > target) {
+    erow *prev = row->lruprev;
+    size_t at = editorRowIndex(row);
+    if (row != keep && (at < E.rowoff || at >= E.rowoff + E.screenrows))
+      editorRowEvict(row);
+    row = prev;
+  }
+}
+
+/*
+ * Record that a row's render and hl were just used, by moving it to the head
+ * of the list of recently used rows, and enforce the memory ceiling now that
+ * they may have grown.
+ */
+void editorRowTouch(erow *row) {
+  if (E.lruhead != row) {
+    editorLruUnlink(row);
+    row->lrunext = E.lruhead;
+    if (E.lruhead)
+      E.lruhead->lruprev = row;
+    else
+      E.lrutail = row;
+    E.lruhead = row;
+  }
+  if (E.memlimit && E.derivedbytes > E.memlimit)
+    editorEvictDerived(row);
+}
+
+/*
+ * Return whether highlighting a row depends on the rows before it, which is
+ * the case when the filetype has multiline comments.
+ */
+int editorSyntaxChains(void) {
+  return E.syntax && E.syntax->multiline_comment_start &&
+         E.syntax->multiline_comment_end;
+}
+
+/*
+ * Make sure the row at a given position has up to date render and hl arrays.
+ * When highlighting depends on earlier rows, the rows between the last known
+ * good row (E.hlvalid) and this one are brought up to date first.
+ */
+void editorRowHighlight(size_t at) {
+  int chain = editorSyntaxChains();
+  if (chain) {
+    while (E.hlvalid < at) {
+      editorRowHighlight(E.hlvalid);
+    }
+  }
+
+  // The previous row's state is read from its leaf, without giving the row
+  // an erow.
+  int off;
+  int prev_open = chain && at > 0 &&
+                  (editorLeafAt(at - 1, &off)->hlstate[off] &
+                   ROW_HL_OPEN_COMMENT);
+  erow *row = editorRowAt(at);
+  unsigned char state = *editorRowHlState(row);
+  int recorded = (state & ROW_HL_IN_COMMENT) != 0;
+
+  // Rebuild only what is stale: the highlighting also goes stale when the
+  // previous row's multiline comment state has changed since.
+  editorRenderRow(row);
+  if (!(state & ROW_HIGHLIGHTED) || recorded != prev_open)
+    editorRowStoreSyntax(row, prev_open);
+  editorRowTouch(row);
+
+  if (E.hlvalid == at)
+    E.hlvalid++;
+}
+
+/*
+ * Return the row at a given position, ready to be displayed.
+ */
+erow *editorRowHighlighted(size_t at) {
+  if (at >= E.numrows)
+    return NULL;
+  editorRowHighlight(at);
+  return editorRowAt(at);
+}
+
+/*
+ * Return the hash of the contents of row j of a leaf, skipping over the
+ * row's gap if it has one. Clean rows match their saved contents, so their
+ * hash is kept in the leaf's savedhash array.
+ */
+uint64_t editorRowHash(struct rownode *leaf, int j) {
+  if ((leaf->flags[j] & (ROW_DIRTY | ROW_HASHED)) == ROW_HASHED)
+    return leaf->savedhash[j];
+
+  const char *chars = leaf->chars[j];
+  size_t size = leaf->size[j];
+  erow *row = leaf->erows ? leaf->erows[j] : NULL;
+  size_t gap = row ? row->gap : size;
+  size_t gaplen = row ? row->gaplen : 0;
+  struct hasher hs;
+  editorHashInit(&hs);
+  editorHashUpdate(&hs, chars, gap);
+  editorHashUpdate(&hs, &chars[gap + gaplen], size - gap);
+  uint64_t h = editorHashFinal(&hs);
+
+  if (!(leaf->flags[j] & ROW_DIRTY)) {
+    editorLeafHashes(leaf);
+    leaf->savedhash[j] = h;
+    leaf->savedsize[j] = size;
+    leaf->flags[j] |= ROW_HASHED;
+  }
+  return h;
+}
+
+/*
+ * Note that a row is about to be changed, which first makes its leaf ready
+ * to be changed (see editorNodeWritable). The first time a row is changed
+ * after the file was opened or saved, its contents are hashed as they were,
+ * so that editorUpdateRow can tell when they are put back the way they were.
+ */
+void editorRowChanging(erow *row) {
+  editorNodeWritable(row->leaf);
+  if (ROW_FLAGS(row) & ROW_DIRTY)
+    return;
+  editorRowHash(row->leaf, row->idx);
+  ROW_FLAGS(row) |= ROW_DIRTY;
+  E.dirtyrows++;
+}
+
+/*
+ * Return whether the buffer differs from the file as it was opened or last
+ * saved. Rows that were added are dirty until the next save, and rows that
+ * were there in the file can only be deleted, so with no dirty rows and the
+ * same number of rows, every row is still the one from the file, unchanged.
+ */
+int editorModified(void) {
+  return E.dirtyrows > 0 || E.numrows != E.savedrows;
+}
+
+/*
+ * Mark a row's render and hl arrays stale after its chars have changed.
+ * They are rebuilt the next time the row is displayed.
+ */
+void editorUpdateRow(erow *row) {
+  struct rownode *leaf = row->leaf;
+  int j = row->idx;
+  row->flags &= ~ROW_RENDERED;
+  leaf->hlstate[j] &= ~ROW_HIGHLIGHTED;
+
+  // A changed row is clean again once it is back to its saved contents.
+  // Hashing is only needed once the size matches.
+  if ((leaf->flags[j] & (ROW_DIRTY | ROW_HASHED)) ==
+          (ROW_DIRTY | ROW_HASHED) &&
+      leaf->size[j] == leaf->savedsize[j] &&
+      editorRowHash(leaf, j) == leaf->savedhash[j]) {
+    leaf->flags[j] &= ~ROW_DIRTY;
+    E.dirtyrows--;
+  }
+
+  // The rows after this one may start in a different multiline comment
+  // state now, and the file up to it needn't be written by the next save.
+  size_t at = editorRowIndex(row);
+  if (at < E.hlvalid)
+    E.hlvalid = at;
+  if ((leaf->flags[j] & ROW_DIRTY) && at < E.firstdirty)
+    E.firstdirty = at;
+}
+
+/*
+ * Throw away the highlighting of every row, for example when the filetype
+ * changes.
+ */
+void editorInvalidateHighlight(void) {
+  int off;
+  for (struct rownode *leaf = editorLeafAt(0, &off); leaf; leaf = leaf->next) {
+    for (int j = 0; j < leaf->n; j++)
+      leaf->hlstate[j] &= ~ROW_HIGHLIGHTED;
+  }
+  E.hlvalid = 0;
+}
+
+/*
+ * Allocate a new, empty tree node.
+ */
+struct rownode *editorNodeNew(int leaf) {
+  // Leaves start without a row array; it is sized as rows are added.
+  struct rownode *node = calloc(1, sizeof(struct rownode));
+  node->leaf = leaf;
+  node->refs = 1;
+  return node;
+}
+
+/*
+ * Add rows to the row count and bytes to the byte count of a node and all of
+ * its ancestors. Both are unsigned, so counts are lowered by passing the
+ * negated amount, which wraps around to the same result.
+ */
+void editorNodeCount(struct rownode *node, size_t rows, size_t bytes) {
+  for (; node; node = node->parent) {
+    node->count += rows;
+    node->bytes += bytes;
+  }
+}
+
+/*
+ * Return the position of a node in its parent's child array.
+ */
+int editorNodeIndex(struct rownode *node) {
+  int i = 0;
+  while (node->parent->child[i] != node)
+    i++;
+  return i;
+}
+
+/*
+ * Make sure a node has a parent, growing the tree by one level (a new root)
+ * if the node is currently the root.
+ */
+void editorNodeEnsureParent(struct rownode *node) {
+  if (node->parent)
+    return;
+  struct rownode *root = editorNodeNew(0);
+  root->n = 1;
+  root->count = node->count;
+  root->bytes = node->bytes;
+  root->child[0] = node;
+  node->parent = root;
+  E.rowroot = root;
+}
+
+/*
+ * Insert a child node into an internal node at position i, splitting the
+ * internal node first if it is full.
+ */
+void editorNodeInsertChild(struct rownode *node, int i,
+                           struct rownode *child) {
+  if (node->n == KILO_NODE_FANOUT) {
+    // Move the upper half of the children over to a new sibling.
+    editorNodeEnsureParent(node);
+    struct rownode *sib = editorNodeNew(0);
+    int half = KILO_NODE_FANOUT / 2;
+    size_t moved = 0;
+    size_t movedbytes = 0;
+    for (int j = half; j < node->n; j++) {
+      sib->child[j - half] = node->child[j];
+      sib->child[j - half]->parent = sib;
+      moved += node->child[j]->count;
+      movedbytes += node->child[j]->bytes;
+    }
+    sib->n = node->n - half;
+    node->n = half;
+
+    // The moved rows leave this node's subtree and come back with the
+    // sibling once it is linked into the parent.
+    editorNodeCount(node, -moved, -movedbytes);
+    sib->count = moved;
+    sib->bytes = movedbytes;
+    editorNodeInsertChild(node->parent, editorNodeIndex(node) + 1, sib);
+
+    // Continue the insertion in whichever half the position is in now.
+    if (i > half) {
+      node = sib;
+      i -= half;
+    }
+  }
+
+  memmove(&node->child[i + 1], &node->child[i],
+          sizeof(struct rownode *) * (node->n - i));
+  node->child[i] = child;
+  node->n++;
+  child->parent = node;
+  editorNodeCount(node, child->count, child->bytes);
+}
+
+/*
+ * Unlink an (empty) node from its parent and free it, removing any parents
+ * that are left without children as well.
+ */
+void editorNodeRemove(struct rownode *node) {
+  struct rownode *parent = node->parent;
+  int i = editorNodeIndex(node);
+  memmove(&parent->child[i], &parent->child[i + 1],
+          sizeof(struct rownode *) * (parent->n - i - 1));
+  parent->n--;
+  editorNodeCount(parent, -node->count, -node->bytes);
+
+  if (node->leaf) {
+    // Keep the chain of leaves intact.
+    if (node->prev)
+      node->prev->next = node->next;
+    if (node->next)
+      node->next->prev = node->prev;
+  }
+  editorLeafFreeArrays(node);
+  free(node);
+
+  if (parent->n == 0)
+    editorNodeRemove(parent);
+}
+
+/*
+ * Find the leaf holding the document row 'at'.
+ * Returns the leaf and stores the position of the row inside the leaf in
+ * *off. For at == E.numrows this returns the last leaf with *off set to the
+ * number of rows in it, which is where a row appended to the end would go.
+ * The leaf may be shared with snapshots, so it is only for reading the rows'
+ * text and sizes and for keeping their derived data (erows, highlighting
+ * state, saved hashes), which snapshots never look at. Use editorFindLeaf
+ * to change it.
+ */
+struct rownode *editorLeafAt(size_t at, int *off) {
+  // Sequential access usually hits the same leaf or the one after it.
+  struct rownode *leaf = E.leafhint;
+  if (leaf && at >= E.leafhint_at) {
+    if (at < E.leafhint_at + leaf->n) {
+      *off = at - E.leafhint_at;
+      return leaf;
+    }
+    if (leaf->next && at < E.leafhint_at + leaf->n + leaf->next->n) {
+      E.leafhint_at += leaf->n;
+      E.leafhint = leaf->next;
+      *off = at - E.leafhint_at;
+      return E.leafhint;
+    }
+  }
+
+  // Otherwise descend from the root, skipping over whole subtrees using
+  // their row counts.
+  size_t first = 0;
+  struct rownode *node = E.rowroot;
+  while (!node->leaf) {
+    int i;
+    for (i = 0; i < node->n - 1 && at - first >= node->child[i]->count;
+         i++) {
+      first += node->child[i]->count;
+    }
+    node = node->child[i];
+  }
+
+  E.leafhint = node;
+  E.leafhint_at = first;
+  *off = at - first;
+  return node;
+}
+
+/*
+ * Find the leaf holding the document row 'at', like editorLeafAt, ready to
+ * be changed even while snapshots share the tree (see editorNodeWritable).
+ */
+struct rownode *editorFindLeaf(size_t at, int *off) {
+  return editorNodeWritable(editorLeafAt(at, off));
+}
+
+/*
+ * Return the row at a given position in the document, or NULL if there is no
+ * such row. The row is given an erow if it doesn't have one yet.
+ * Looking rows up, to draw or search them, never copies a leaf shared with
+ * a snapshot: that only happens once a row is changed (see
+ * editorRowChanging).
+ */
+erow *editorRowAt(size_t at) {
+  if (at >= E.numrows)
+    return NULL;
+  int off;
+  struct rownode *leaf = editorLeafAt(at, &off);
+  return editorLeafRow(leaf, off);
+}
+
+/*
+ * Return the size of the row at a given position, or 0 if there is no such
+ * row, without giving the row an erow.
+ */
+size_t editorRowSize(size_t at) {
+  if (at >= E.numrows)
+    return 0;
+  int off;
+  return editorLeafAt(at, &off)->size[off];
+}
+
+/*
+ * Return the position of a row in the document, worked out from its position
+ * in its leaf plus the row counts of everything to the left of the leaf.
+ * This takes O(log n) steps, and means inserting or deleting a row never has
+ * to renumber the rows that follow it.
+ */
+size_t editorRowIndex(erow *row) {
+  struct rownode *node = row->leaf;
+  size_t at = row->idx;
+  for (; node->parent; node = node->parent) {
+    for (int i = 0; node->parent->child[i] != node; i++)
+      at += node->parent->child[i]->count;
+  }
+  return at;
+}
+
+/*
+ * Return the byte offset at which the row at position 'at' starts in the
+ * file as it would be saved, or the length of the file for at == E.numrows.
+ * This descends from the root, skipping over whole subtrees using their
+ * row and byte counts, and then adds up the sizes of the rows before 'at'
+ * in its leaf.
+ */
+size_t editorRowOffset(size_t at) {
+  if (at >= E.numrows)
+    return E.rowroot->bytes;
+
+  size_t off = 0;
+  struct rownode *node = E.rowroot;
+  while (!node->leaf) {
+    int i;
+    for (i = 0; i < node->n - 1 && at >= node->child[i]->count; i++) {
+      at -= node->child[i]->count;
+      off += node->child[i]->bytes;
+    }
+    node = node->child[i];
+  }
+  for (size_t j = 0; j < at; j++)
+    off += node->size[j] + 1;
+  return off;
+}
+
+/*
+ * Return the position of the row holding byte offset 'off' of the file as
+ * it would be saved, with extra more bytes for every line ending (1 for a
+ * file with \r\n line endings, see editorEolExtra), and store the offset
+ * within that row in *col (the row's size for its line ending). Offsets
+ * past the end of the file give E.numrows, with *col set to 0.
+ */
+size_t editorOffsetRow(size_t off, int extra, size_t *col) {
+  *col = 0;
+  if (off >= E.rowroot->bytes + E.numrows * extra)
+    return E.numrows;
+
+  size_t at = 0;
+  struct rownode *node = E.rowroot;
+  while (!node->leaf) {
+    int i;
+    for (i = 0; i < node->n - 1; i++) {
+      size_t bytes = node->child[i]->bytes + node->child[i]->count * extra;
+      if (off < bytes)
+        break;
+      off -= bytes;
+      at += node->child[i]->count;
+    }
+    node = node->child[i];
+  }
+  int j = 0;
+  while (off >= node->size[j] + 1 + extra) {
+    off -= node->size[j] + 1 + extra;
+    j++;
+  }
+  *col = off < node->size[j] ? off : node->size[j];
+  return at + j;
+}
+
+/*
+ * Return how many bytes each line ending of the file takes beyond its \n:
+ * 0 for \n line endings and 1 for \r\n, or -1 when the file mixes both, so
+ * that offsets in it can't be worked out from the rows.
+ */
+int editorEolExtra(void) {
+  if (!(E.eol & EOL_CRLF))
+    return 0;
+  return E.eol & EOL_LF ? -1 : 1;
+}
+
+/*
+ * Move n rows, along with their metadata, from position 'from' of one leaf
+ * to position 'to' of another (or the same) leaf, and point their erows at
+ * their new places. The ranges may overlap.
+ */
+void editorLeafMove(struct rownode *dst, int to, struct rownode *src, int from,
+                    int n) {
+  memmove(&dst->chars[to], &src->chars[from], sizeof(char *) * n);
+  memmove(&dst->size[to], &src->size[from], sizeof(size_t) * n);
+  memmove(&dst->flags[to], &src->flags[from], n);
+  memmove(&dst->hlstate[to], &src->hlstate[from], n);
+  if (src->savedhash) {
+    editorLeafHashes(dst);
+    memmove(&dst->savedhash[to], &src->savedhash[from], sizeof(uint64_t) * n);
+    memmove(&dst->savedsize[to], &src->savedsize[from], sizeof(size_t) * n);
+  }
+  if (src->erows) {
+    if (dst->erows == NULL)
+      dst->erows = calloc(dst->cap, sizeof(erow *));
+    memmove(&dst->erows[to], &src->erows[from], sizeof(erow *) * n);
+    for (int j = to; j < to + n; j++) {
+      if (dst->erows[j]) {
+        dst->erows[j]->leaf = dst;
+        dst->erows[j]->idx = j;
+      }
+    }
+  } else if (dst->erows) {
+    memset(&dst->erows[to], 0, sizeof(erow *) * n);
+  }
+}
+
+/*
+ * Resize a leaf's arrays to the capacity needed to hold need rows.
+ */
+void editorLeafReserve(struct rownode *leaf, int need) {
+  // Leaves in a scratch file always get room for KILO_LEAF_ROWS rows, so
+  // that their blocks all have the same size and are easily recycled.
+  int cap = E.scratch.fd != -1 ? KILO_LEAF_ROWS
+                               : (int)editorCapacity(leaf->cap, need);
+  if (cap > KILO_LEAF_ROWS)
+    cap = KILO_LEAF_ROWS;
+  if (cap == leaf->cap)
+    return;
+
+  int n = leaf->n < cap ? leaf->n : cap;
+  char *block = editorScratchAlloc(KILO_LEAF_ROW_BYTES * cap);
+  char **chars = (char **)block;
+  size_t *size = (size_t *)&chars[cap];
+  unsigned char *flags = (unsigned char *)&size[cap];
+  unsigned char *hlstate = &flags[cap];
+  if (leaf->chars) {
+    memcpy(chars, leaf->chars, sizeof(char *) * n);
+    memcpy(size, leaf->size, sizeof(size_t) * n);
+    memcpy(flags, leaf->flags, n);
+    memcpy(hlstate, leaf->hlstate, n);
+    editorScratchFree(leaf->chars, KILO_LEAF_ROW_BYTES * leaf->cap);
+  }
+  leaf->chars = chars;
+  leaf->size = size;
+  leaf->flags = flags;
+  leaf->hlstate = hlstate;
+
+  if (leaf->erows)
+    leaf->erows = realloc(leaf->erows, sizeof(erow *) * cap);
+  if (leaf->savedhash) {
+    uint64_t *hash = editorScratchAlloc(KILO_LEAF_HASH_BYTES * cap);
+    size_t *hashsize = (size_t *)&hash[cap];
+    memcpy(hash, leaf->savedhash, sizeof(uint64_t) * n);
+    memcpy(hashsize, leaf->savedsize, sizeof(size_t) * n);
+    editorScratchFree(leaf->savedhash, KILO_LEAF_HASH_BYTES * leaf->cap);
+    leaf->savedhash = hash;
+    leaf->savedsize = hashsize;
+  }
+  leaf->cap = cap;
+}
+
+/*
+ * Free the arrays of a node (see editorLeafReserve), which internal nodes
+ * don't have.
+ */
+void editorLeafFreeArrays(struct rownode *node) {
+  editorScratchFree(node->chars, KILO_LEAF_ROW_BYTES * node->cap);
+  editorScratchFree(node->savedhash, KILO_LEAF_HASH_BYTES * node->cap);
+  free(node->erows);
+}
+
+/*
+ * Give a leaf its savedhash and savedsize arrays, if it doesn't have them
+ * yet.
+ */
+void editorLeafHashes(struct rownode *leaf) {
+  if (leaf->savedhash)
+    return;
+  leaf->savedhash = editorScratchAlloc(KILO_LEAF_HASH_BYTES * leaf->cap);
+  leaf->savedsize = (size_t *)&leaf->savedhash[leaf->cap];
+}
+
+/*
+ * Builds rows for loading a file, a leaf at a time, as a chain of leaves
+ * (linked through prev and next) that is then added to the buffer with
+ * editorLoadAppend. Building the chain touches nothing outside of it, so
+ * several parts of a file can be loaded by different threads at once.
+ */
+struct rowloader {
+  // The first leaf of the chain, and the one being filled.
+  struct rownode *first;
+  struct rownode *leaf;
+  // The background load the chain is part of, if any (see struct loadjob),
+  // and whether it was cancelled.
+  struct loadjob *job;
+  int stop;
+  // The line endings found (see E.eol).
+  int eol;
+};
+
+/*
+ * One part of a file being loaded by editorLoadSplit, or in the background
+ * (see struct loadjob).
+ */
+struct loadpart {
+  pthread_t thread;
+  int threaded;
+  char *start;
+  char *end;
+  struct rowloader ld;
+  // Whether a background part is done, guarded by the job's lock.
+  int done;
+};
+
+/*
+ * The rest of a large file, being loaded in the background after its first
+ * KILO_LOAD_PREFIX bytes (see editorOpen), while the buffer can already be
+ * viewed and edited. It is cut into parts of KILO_LOAD_PART_MIN bytes, which
+ * a few threads take in turn and split into chains of rows. As each part is
+ * done, editorLoadPoll appends its chain to the buffer on the main thread,
+ * in file order, so the buffer grows while the rest loads. Until the last
+ * part is in the buffer ends early: anything that needs the whole file
+ * (going to the end, searching, saving) waits for the load with
+ * editorLoadWait.
+ */
+struct loadjob {
+  pthread_t threads[KILO_LOAD_PARTS_MAX];
+  int nthreads;
+  char *start;
+  size_t len;
+  struct loadpart *parts;
+  size_t nparts;
+  // The next part to append to the buffer, used by the main thread alone.
+  size_t appended;
+  // The next part for a thread to take, the progress of the parts not yet
+  // in the buffer, and whether to stop early, all guarded by lock.
+  pthread_mutex_t lock;
+  size_t taken;
+  size_t bytes;
+  size_t rows;
+  int cancel;
+};
+
+/*
+ * Count the rows of a filled leaf towards a background load's progress, and
+ * stop the chain if the load was cancelled.
+ */
+void editorLoadProgress(struct rowloader *ld, struct rownode *leaf) {
+  struct loadjob *job = ld->job;
+  pthread_mutex_lock(&job->lock);
+  job->bytes += leaf->bytes;
+  job->rows += leaf->n;
+  ld->stop = job->cancel;
+  pthread_mutex_unlock(&job->lock);
+}
+
+/*
+ * Start a new, empty chain.
+ */
+void editorLoadBegin(struct rowloader *ld) {
+  ld->stop = 0;
+  ld->eol = 0;
+  ld->first = ld->leaf = editorNodeNew(1);
+  editorLeafReserve(ld->leaf, KILO_LEAF_ROWS);
+}
+
+/*
+ * Append a row pointing at len bytes at s, which must outlive the row (the
+ * file mapping or an interned string), with the given ROW_* flags. This
+ * fills in the leaf's arrays directly: unlike
+ * editorInsertRowData, nothing is looked up, shifted or invalidated per row.
+ */
+void editorLoadRow(struct rowloader *ld, char *s, size_t len, int flags) {
+  struct rownode *leaf = ld->leaf;
+  if (leaf->n == KILO_LEAF_ROWS) {
+    if (ld->job)
+      editorLoadProgress(ld, leaf);
+    leaf = editorNodeNew(1);
+    editorLeafReserve(leaf, KILO_LEAF_ROWS);
+    leaf->prev = ld->leaf;
+    ld->leaf->next = leaf;
+    ld->leaf = leaf;
+  }
+
+  int j = leaf->n++;
+  leaf->chars[j] = s;
+  leaf->size[j] = len;
+  leaf->flags[j] = flags;
+  leaf->hlstate[j] = 0;
+  leaf->count++;
+  leaf->bytes += len + 1;
+}
+
+/*
+ * Finish a chain, giving back the room its last leaf doesn't use.
+ */
+void editorLoadEnd(struct rowloader *ld) {
+  if (ld->job)
+    editorLoadProgress(ld, ld->leaf);
+  editorLeafReserve(ld->leaf, ld->leaf->n);
+}
+
+/*
+ * Free a chain of leaves, from leaf on, that won't be added to the buffer.
+ */
+void editorLoadDrop(struct rownode *leaf) {
+  struct rownode *next;
+  for (; leaf; leaf = next) {
+    next = leaf->next;
+    editorNodeFree(leaf);
+  }
+}
+
+/*
+ * Add the leaves of a finished chain to the end of the buffer. Their row and
+ * byte counts are complete, so the tree's counts are updated once per leaf
+ * rather than once per row.
+ */
+void editorLoadAppend(struct rowloader *ld) {
+  // Saving turns \r\n into \n, so it won't write the file as it is (see
+  // editorFileSame).
+  E.eol |= ld->eol;
+  if (ld->eol & EOL_CRLF)
+    E.filestknown = 0;
+
+  struct rownode *last = E.rowroot;
+  while (!last->leaf)
+    last = last->child[last->n - 1];
+
+  struct rownode *leaf = ld->first;
+  if (E.numrows == 0) {
+    // An empty buffer is a single empty leaf, which the chain replaces.
+    editorNodeFree(E.rowroot);
+    E.rowroot = last = leaf;
+    E.numrows = leaf->n;
+    leaf = leaf->next;
+  } else if (leaf->n == 0) {
+    // A chain only starts with an empty leaf when it has no rows at all.
+    editorLoadDrop(leaf);
+    return;
+  }
+
+  for (; leaf; leaf = leaf->next) {
+    leaf->prev = last;
+    last->next = leaf;
+    editorNodeEnsureParent(last);
+    editorNodeInsertChild(last->parent, editorNodeIndex(last) + 1, leaf);
+    E.numrows += leaf->n;
+    last = leaf;
+  }
+  E.leafhint = NULL;
+}
+
+/*
+ * Return the length of a line of len bytes at p, not counting its \n (nl is
+ * set if it has one), without the carriage returns at its end, and note the
+ * line's ending in ld->eol.
+ */
+size_t editorLoadStrip(struct rowloader *ld, char *p, size_t len, int nl) {
+  int crs = 0;
+  while (len > 0 && p[len - 1] == '\r') {
+    len--;
+    crs++;
+  }
+  if (crs > 0)
+    ld->eol |= EOL_CRLF;
+  if (nl && crs != 1)
+    ld->eol |= EOL_LF;
+  return len;
+}
+
+/*
+ * Split the lines of a mapped file that start from p up to stop into rows,
+ * building a chain. The last line may run on past stop, up to end.
+ * memchr is vectorized by the C library, so this runs at memory speed.
+ */
+void editorLoadMapped(struct rowloader *ld, char *p, char *stop, char *end) {
+  editorLoadBegin(ld);
+  while (p < stop && !ld->stop) {
+    char *nl = memchr(p, '\n', end - p);
+    size_t linelen = editorLoadStrip(ld, p, (nl ? nl : end) - p, nl != NULL);
+    editorLoadRow(ld, p, linelen, ROW_MAPPED);
+    p = nl ? nl + 1 : end;
+  }
+  editorLoadEnd(ld);
+}
+
+void *editorLoadPartThread(void *arg) {
+  struct loadpart *part = arg;
+  editorLoadMapped(&part->ld, part->start, part->end, part->end);
+  return NULL;
+}
+
+/*
+ * Split len bytes of a mapped file into chains of rows, one per part (see
+ * struct rowloader). Large files are cut into one part per CPU at newline
+ * boundaries, and the parts are split into rows by separate threads.
+ * Returns the number of parts.
+ */
+size_t editorLoadSplit(char *map, size_t len, struct loadpart *parts,
+                       struct loadjob *job) {
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t nparts = len / KILO_LOAD_PART_MIN;
+  if (cpus > 0 && nparts > (size_t)cpus)
+    nparts = cpus;
+  if (nparts > KILO_LOAD_PARTS_MAX)
+    nparts = KILO_LOAD_PARTS_MAX;
+  if (nparts < 1)
+    nparts = 1;
+
+  char *p = map;
+  char *end = map + len;
+  for (size_t i = 0; i < nparts; i++) {
+    // Each part ends just after the first newline past its share of the
+    // file, and the last one at the end of the file.
+    char *cut = end;
+    if (i < nparts - 1) {
+      char *nl = memchr(map + len / nparts * (i + 1), '\n',
+                        end - (map + len / nparts * (i + 1)));
+      cut = nl ? nl + 1 : end;
+    }
+    if (cut < p)
+      cut = p;
+    parts[i].start = p;
+    parts[i].end = cut;
+    parts[i].ld.job = job;
+    p = cut;
+  }
+
+  // The first part is loaded on this thread while the other threads load
+  // the rest.
+  for (size_t i = 1; i < nparts; i++) {
+    parts[i].threaded = pthread_create(&parts[i].thread, NULL,
+                                       editorLoadPartThread, &parts[i]) == 0;
+  }
+  editorLoadMapped(&parts[0].ld, parts[0].start, parts[0].end, parts[0].end);
+  for (size_t i = 1; i < nparts; i++) {
+    if (parts[i].threaded)
+      pthread_join(parts[i].thread, NULL);
+    else
+      editorLoadPartThread(&parts[i]);
+  }
+  return nparts;
+}
+
+/*
+ * Load a mapped file into the (empty) buffer, all at once.
+ */
+void editorLoadParallel(char *map, size_t len) {
+  struct loadpart parts[KILO_LOAD_PARTS_MAX];
+  size_t nparts = editorLoadSplit(map, len, parts, NULL);
+  for (size_t i = 0; i < nparts; i++)
+    editorLoadAppend(&parts[i].ld);
+}
+
+/*
+ * Take the parts of a background load in turn and split them into rows,
+ * until none are left or the load is cancelled.
+ */
+void *editorLoadThread(void *arg) {
+  struct loadjob *job = arg;
+  for (;;) {
+    pthread_mutex_lock(&job->lock);
+    if (job->cancel || job->taken == job->nparts) {
+      pthread_mutex_unlock(&job->lock);
+      return NULL;
+    }
+    struct loadpart *part = &job->parts[job->taken++];
+    pthread_mutex_unlock(&job->lock);
+
+    // A part holds the lines that start in it, so the line that runs into
+    // it from the part before belongs to that part.
+    char *p = part->start;
+    if (p > job->start) {
+      char *nl = memchr(p - 1, '\n', part->end - (p - 1));
+      p = nl ? nl + 1 : part->end;
+    }
+    editorLoadMapped(&part->ld, p, part->end, job->start + job->len);
+
+    pthread_mutex_lock(&job->lock);
+    part->done = 1;
+    pthread_mutex_unlock(&job->lock);
+  }
+}
+
+/*
+ * Start loading len bytes at start, the rest of the mapped file, in the
+ * background. Falls back to loading them right away if no thread can be
+ * started.
+ */
+void editorLoadStart(char *start, size_t len) {
+  struct loadjob *job = calloc(1, sizeof(struct loadjob));
+  job->start = start;
+  job->len = len;
+  job->nparts = (len + KILO_LOAD_PART_MIN - 1) / KILO_LOAD_PART_MIN;
+  job->parts = calloc(job->nparts, sizeof(struct loadpart));
+  for (size_t i = 0; i < job->nparts; i++) {
+    job->parts[i].start = start + i * KILO_LOAD_PART_MIN;
+    job->parts[i].end = job->parts[i].start + KILO_LOAD_PART_MIN;
+    job->parts[i].ld.job = job;
+  }
+  job->parts[job->nparts - 1].end = start + len;
+  pthread_mutex_init(&job->lock, NULL);
+
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t nthreads = cpus > 0 ? (size_t)cpus : 1;
+  if (nthreads > KILO_LOAD_PARTS_MAX)
+    nthreads = KILO_LOAD_PARTS_MAX;
+  if (nthreads > job->nparts)
+    nthreads = job->nparts;
+  while ((size_t)job->nthreads < nthreads &&
+         pthread_create(&job->threads[job->nthreads], NULL, editorLoadThread,
+                        job) == 0) {
+    job->nthreads++;
+  }
+  if (job->nthreads == 0) {
+    pthread_mutex_destroy(&job->lock);
+    free(job->parts);
+    free(job);
+    editorLoadParallel(start, len);
+    return;
+  }
+  E.load = job;
+}
+
+/*
+ * Add the rows of the next part of the background load, which must be done,
+ * to the end of the buffer.
+ */
+void editorLoadNext(struct loadjob *job) {
+  size_t numrows = E.numrows;
+  size_t bytes = E.rowroot->bytes;
+  editorLoadAppend(&job->parts[job->appended++].ld);
+  // The loaded rows are as they are in the file.
+  E.savedrows += E.numrows - numrows;
+
+  pthread_mutex_lock(&job->lock);
+  job->rows -= E.numrows - numrows;
+  job->bytes -= E.rowroot->bytes - bytes;
+  pthread_mutex_unlock(&job->lock);
+}
+
+/*
+ * Wait for the background load to complete (or, with cancel set, stop it),
+ * and add the rows it loaded to the end of the buffer.
+ */
+void editorLoadFinish(int cancel) {
+  struct loadjob *job = E.load;
+  if (job == NULL)
+    return;
+  if (cancel) {
+    pthread_mutex_lock(&job->lock);
+    job->cancel = 1;
+    pthread_mutex_unlock(&job->lock);
+  }
+  for (int i = 0; i < job->nthreads; i++)
+    pthread_join(job->threads[i], NULL);
+  E.load = NULL;
+
+  // Parts no thread got to have no chain.
+  while (job->appended < job->nparts) {
+    if (cancel)
+      editorLoadDrop(job->parts[job->appended++].ld.first);
+    else
+      editorLoadNext(job);
+  }
+  pthread_mutex_destroy(&job->lock);
+  free(job->parts);
+  free(job);
+}
+
+/*
+ * Wait for the whole file to be loaded, letting the user know why nothing
+ * seems to happen.
+ */
+void editorLoadWait(void) {
+  if (E.load == NULL)
+    return;
+  editorSetStatusMessage("Loading the rest of the file...");
+  editorRefreshScreen();
+  editorLoadFinish(0);
+  editorSetStatusMessage("");
+}
+
+/*
+ * Add the parts of the background load that are done to the buffer, in
+ * order, and update the load progress on screen, without waiting. The load
+ * is finished once its last part is in. Called while waiting for keypresses.
+ */
+void editorLoadPoll(void) {
+  struct loadjob *job = E.load;
+  if (job == NULL)
+    return;
+  for (;;) {
+    pthread_mutex_lock(&job->lock);
+    int done = job->appended < job->nparts && job->parts[job->appended].done;
+    pthread_mutex_unlock(&job->lock);
+    if (!done)
+      break;
+    editorLoadNext(job);
+  }
+  if (job->appended == job->nparts)
+    editorLoadFinish(0);
+  editorRefreshScreen();
+}
+
+/*
+ * Copy a node that is shared with a snapshot, and put the copy in its place
+ * in the live tree, leaving the original to the snapshots. The node's parent
+ * must already belong to the live tree alone.
+ * The children of a copied internal node become shared between the copy and
+ * the original. The rows of a copied leaf share their text with the
+ * original's rows, and their erows move over to the copy, marked
+ * ROW_SHARED.
+ */
+struct rownode *editorNodeCopy(struct rownode *node) {
+  struct rownode *copy = editorNodeNew(node->leaf);
+  copy->parent = node->parent;
+  copy->n = node->n;
+  copy->count = node->count;
+  copy->bytes = node->bytes;
+
+  if (node->leaf) {
+    editorLeafReserve(copy, node->n);
+    editorLeafMove(copy, 0, node, 0, node->n);
+    // Only the live tree uses erows, so they move over to the copy.
+    if (node->erows) {
+      for (int j = 0; j < copy->n; j++) {
+        if (copy->erows[j])
+          copy->erows[j]->flags |= ROW_SHARED;
+      }
+      free(node->erows);
+      node->erows = NULL;
+    }
+
+    // Swap the copy into the chain of leaves.
+    copy->prev = node->prev;
+    copy->next = node->next;
+    if (node->prev)
+      node->prev->next = copy;
+    if (node->next)
+      node->next->prev = copy;
+  } else {
+    for (int i = 0; i < node->n; i++) {
+      copy->child[i] = node->child[i];
+      copy->child[i]->parent = copy;
+      copy->child[i]->refs++;
+    }
+  }
+
+  if (node->parent)
+    node->parent->child[editorNodeIndex(node)] = copy;
+  else
+    E.rowroot = copy;
+  node->refs--;
+
+  if (E.leafhint == node)
+    E.leafhint = copy;
+  return copy;
+}
+
+/*
+ * Return a node of the live tree, ready to be changed: nodes reachable from
+ * a snapshot are copied first, from the root down to the node.
+ */
+struct rownode *editorNodeWritable(struct rownode *node) {
+  if (E.snapshots == 0)
+    return node;
+  if (node->parent)
+    editorNodeWritable(node->parent);
+  if (node->refs > 1)
+    node = editorNodeCopy(node);
+  return node;
+}
+
+/*
+ * Return the leaf after a given one, ready to be changed (see
+ * editorNodeWritable), or NULL after the last leaf.
+ */
+struct rownode *editorLeafNext(struct rownode *leaf) {
+  return leaf->next ? editorNodeWritable(leaf->next) : NULL;
+}
+
+/*
+ * Open up an empty row slot at document position 'at', and return the leaf
+ * holding it, with its position in the leaf in *slot. Only the rows of a
+ * single leaf are moved to make room.
+ */
+struct rownode *editorTreeInsert(size_t at, int *slot) {
+  int off;
+  struct rownode *leaf = editorFindLeaf(at, &off);
+
+  if (leaf->n == KILO_LEAF_ROWS) {
+    // Split the full leaf. When appending to the end of the leaf (loading a
+    // file, typing at the bottom), start a fresh leaf instead of moving half
+    // the rows, so that loaded leaves end up full.
+    editorNodeEnsureParent(leaf);
+    struct rownode *sib = editorNodeNew(1);
+    int split = (off == leaf->n) ? off : leaf->n / 2;
+    editorLeafReserve(sib, leaf->n - split + 1);
+    sib->n = leaf->n - split;
+    editorLeafMove(sib, 0, leaf, split, sib->n);
+    leaf->n = split;
+    size_t movedbytes = 0;
+    for (int j = 0; j < sib->n; j++)
+      movedbytes += sib->size[j] + 1;
+    editorNodeCount(leaf, -sib->n, -movedbytes);
+    sib->count = sib->n;
+    sib->bytes = movedbytes;
+
+    // Link the new leaf in after the old one.
+    sib->prev = leaf;
+    sib->next = leaf->next;
+    if (leaf->next)
+      leaf->next->prev = sib;
+    leaf->next = sib;
+    editorNodeInsertChild(leaf->parent, editorNodeIndex(leaf) + 1, sib);
+
+    if (off >= split) {
+      leaf = sib;
+      off -= split;
+    }
+  }
+
+  // Grow the leaf's row array if it is out of room.
+  if (leaf->n == leaf->cap)
+    editorLeafReserve(leaf, leaf->n + 1);
+
+  editorLeafMove(leaf, off + 1, leaf, off, leaf->n - off);
+  leaf->n++;
+  // The new row is empty, which leaves just its newline.
+  editorNodeCount(leaf, 1, 1);
+  leaf->chars[off] = NULL;
+  leaf->size[off] = 0;
+  leaf->flags[off] = 0;
+  leaf->hlstate[off] = 0;
+  if (leaf->erows)
+    leaf->erows[off] = NULL;
+
+  // The tree changed shape, so drop the lookup cache.
+  E.leafhint = NULL;
+  *slot = off;
+  return leaf;
+}
+
+/*
+ * Remove the row slot at document position 'at' from the tree.
+ */
+void editorTreeDelete(size_t at) {
+  int off;
+  struct rownode *leaf = editorFindLeaf(at, &off);
+  editorNodeCount(leaf, -1, -(leaf->size[off] + 1));
+  editorLeafMove(leaf, off, leaf, off + 1, leaf->n - off - 1);
+  leaf->n--;
+  E.leafhint = NULL;
+
+  // Give back memory once the leaf is mostly empty.
+  editorLeafReserve(leaf, leaf->n);
+
+  // Fold a sparse leaf's next neighbor into it when they share a parent and
+  // fit in one leaf, so that deletes don't leave a trail of tiny leaves.
+  struct rownode *next = leaf->next;
+  if (leaf->n < KILO_LEAF_ROWS / 4 && next && next->parent == leaf->parent &&
+      leaf->n + next->n <= KILO_LEAF_ROWS) {
+    next = editorNodeWritable(next);
+    editorLeafReserve(leaf, leaf->n + next->n);
+    editorLeafMove(leaf, leaf->n, next, 0, next->n);
+    leaf->n += next->n;
+    leaf->count += next->n;
+    leaf->bytes += next->bytes;
+    next->count = 0;
+    next->bytes = 0;
+    next->n = 0;
+    editorNodeRemove(next);
+  }
+
+  // Drop empty leaves, but always keep at least one leaf in the tree.
+  if (leaf->n == 0 && leaf->parent)
+    editorNodeRemove(leaf);
+
+  // Shrink the tree while the root only has a single child.
+  while (!E.rowroot->leaf && E.rowroot->n == 1) {
+    struct rownode *root = E.rowroot;
+    E.rowroot = root->child[0];
+    E.rowroot->parent = NULL;
+    free(root);
+  }
+}
+
+/*
+ * Add a row as a string with length len as a new row in the editor at a given
+ * position, 'at'. Rows added while editing have ROW_DIRTY in flags, and rows
+ * read from the file don't. With ROW_MAPPED in flags, the row points at s
+ * instead of copying it, so s must be inside E.map, or interned (with
+ * ROW_INTERNED in flags as well).
+ */
+void editorInsertRowData(size_t at, char *s, size_t len, int flags) {
+  if (at > E.numrows)
+    return;
+
+  // Rows move around inside their leaf when the tree changes, so close any
+  // open gap before the row holding it is moved.
+  editorGapFlush();
+
+  // Make room at the specified index for the new row. The rows that follow
+  // don't store their index, so nothing else needs to be touched.
+  int off;
+  struct rownode *leaf = editorTreeInsert(at, &off);
+  leaf->flags[off] = flags;
+  if (flags & ROW_DIRTY)
+    E.dirtyrows++;
+
+  erow *row = editorLeafRow(leaf, off);
+  if (flags & ROW_MAPPED) {
+    // Mapped rows need no block until they are displayed.
+    ROW_CHARS(row) = s;
+  } else {
+    // render and hl are only given room once the row is first displayed.
+    editorRowLayout(row, len + 1, 0, 0, 0);
+
+    // copy the len bytes from memory address s to the memory addresses
+    // starting with the start-point of the new row.
+    memcpy(ROW_CHARS(row), s, len);
+    ROW_CHARS(row)[len] = '\0';
+  }
+  editorRowSetSize(row, len);
+
+  // New rows start out without a gap.
+  row->gap = len;
+  row->gaplen = 0;
+
+  // Let the editor know how long the rows array is.
+  E.numrows++;
+
+  // Let the highlighting know a row appeared here.
+  editorUpdateRow(row);
+
+  E.dirty++;
+}
+
+/*
+ * Add a copy of a string with length len as a new row at position 'at'.
+ */
+void editorInsertRow(size_t at, char *s, size_t len) {
+  editorInsertRowData(at, s, len, ROW_DIRTY);
+}
+
+/*
+ * Free the block holding the raw, rendered and highlight arrays of a given
+ * editor row, and the row's erow.
+ */
+void editorFreeRow(erow *row) {
+  E.derivedbytes -= (row->flags & ROW_RENDER_ALIAS ? 0 : row->rcap) + row->hlcap;
+  if (row->block)
+    editorRowReleaseBlock(row);
+  editorRowDrop(row);
+}
+
+/*
+ * Completely delete a single row.
+ */
+void editorDelRow(size_t at) {
+  if (at >= E.numrows)
+    return;
+
+  editorGapFlush();
+
+  // Free the memory owned by the row to delete, if it has an erow.
+  int off;
+  struct rownode *leaf = editorFindLeaf(at, &off);
+  if (leaf->flags[off] & ROW_DIRTY)
+    E.dirtyrows--;
+  if (leaf->erows && leaf->erows[off])
+    editorFreeRow(leaf->erows[off]);
+
+  // Remove the row from the tree, which only shifts the rows that follow it
+  // within the same leaf.
+  editorTreeDelete(at);
+  E.numrows--;
+
+  // The rows after this one may start in a different multiline comment
+  // state now, and have moved in the file.
+  if (at < E.hlvalid)
+    E.hlvalid = at;
+  if (at < E.firstdirty)
+    E.firstdirty = at;
+
+  E.dirty++;
+}
+
+/*
+ * Close the gap of the row currently being edited (if any), moving the text
+ * after the gap back down so that the row's chars are one contiguous string
+ * again.
+ */
+void editorGapFlush(void) {
+  erow *row = E.gaprow;
+  if (row == NULL)
+    return;
+
+  // Move the tail, including the \0 byte at the end, down over the gap.
+  char *chars = ROW_CHARS(row);
+  size_t size = ROW_SIZE(row);
+  memmove(&chars[row->gap], &chars[row->gap + row->gaplen],
+          size - row->gap + 1);
+  row->gap = size;
+  row->gaplen = 0;
+  E.gaprow = NULL;
+
+  // Give back the spare capacity if the row is now mostly empty.
+  editorRowReserve(row, size + 1);
+}
+
+/*
+ * Move the gap of a row to position 'at', opening a gap on the row first if
+ * it doesn't have one. Only one row holds a gap at a time, so opening a gap
+ * on a new row flushes the previous one.
+ */
+void editorRowMoveGap(erow *row, size_t at) {
+  editorRowOwn(row);
+  if (E.gaprow != row) {
+    editorGapFlush();
+    E.gaprow = row;
+  }
+
+  size_t size = ROW_SIZE(row);
+  if (row->gaplen == 0) {
+    // Make sure there is at least one byte of spare capacity (growing the
+    // allocation geometrically if needed), then turn all of the spare
+    // capacity into the gap by moving the tail to the end of the allocation.
+    editorRowReserve(row, size + 2);
+    size_t gaplen = row->cap - size - 1;
+    memmove(&ROW_CHARS(row)[row->gap + gaplen], &ROW_CHARS(row)[row->gap],
+            size - row->gap + 1);
+    row->gaplen = gaplen;
+  }
+
+  char *chars = ROW_CHARS(row);
+  if (at < row->gap) {
+    // Move the characters between 'at' and the gap to after the gap.
+    memmove(&chars[at + row->gaplen], &chars[at], row->gap - at);
+  } else if (at > row->gap) {
+    // Move the characters between the gap and 'at' to before the gap.
+    memmove(&chars[row->gap], &chars[row->gap + row->gaplen], at - row->gap);
+  }
+  row->gap = at;
+}
+
+/*
+ * Insert a single character at a given position in an existing row.
+ * Note that this function does not need to know the details of the
+ * cursor positioning, it only worries about the memory operations required
+ * to insert the character.
+ */
+void editorRowInsertChar(erow *row, size_t at, int c) {
+  // Validate 'at', noting that it can be 1 position past the end of the row
+  // in which case it needs to be moved placed at the actual end of the row
+  // (its size).
+  if (at > ROW_SIZE(row))
+    at = ROW_SIZE(row);
+
+  // Put the row's gap at the insert position. While the user keeps typing
+  // the gap is already there, so nothing has to be moved or reallocated.
+  editorRowChanging(row);
+  editorRowMoveGap(row, at);
+
+  // Insert the new character into the start of the gap.
+  ROW_CHARS(row)[row->gap++] = c;
+  row->gaplen--;
+
+  // Let the row know its new size and persist it to the editor.
+  editorRowSetSize(row, ROW_SIZE(row) + 1);
+  editorUpdateRow(row);
+
+  E.dirty++;
+}
+
+/*
+ * Append a given string s of length len to a given editor row.
+ */
+void editorRowAppendString(erow *row, char *s, size_t len) {
+  editorRowChanging(row);
+
+  // Appending works on the contiguous string, in memory of the row's own.
+  if (E.gaprow == row)
+    editorGapFlush();
+  editorRowOwn(row);
+
+  // Make sure the row has room for the new string, plus 1 more for the EOL
+  // null byte.
+  size_t size = ROW_SIZE(row);
+  editorRowReserve(row, size + len + 1);
+
+  // Copy the contents of s to the end of the row's chars array.
+  memcpy(&ROW_CHARS(row)[size], s, len);
+
+  // Update the stored row size.
+  editorRowSetSize(row, size + len);
+  row->gap = size + len;
+
+  // Add the EOL null byte.
+  ROW_CHARS(row)[size + len] = '\0';
+
+  // Persist the change to the editor row.
+  editorUpdateRow(row);
+  E.dirty++;
+}
+
+/*
+ * Delete a single character at a given position in an existing row.
+ */
+void editorRowDelChar(erow *row, size_t at) {
+  // Validate 'at', noting that if its at an invalid position we can return.
+  if (at >= ROW_SIZE(row))
+    return;
+  editorRowChanging(row);
+
+  // Put the gap right after the character and widen the gap over it, which
+  // makes repeated backspacing free.
+  editorRowMoveGap(row, at + 1);
+  row->gap--;
+  row->gaplen++;
+
+  // Decrement the row size and persist the change to the editor.
+  editorRowSetSize(row, ROW_SIZE(row) - 1);
+  editorUpdateRow(row);
+
+  E.dirty++;
+}
+
+/*** editor operations ***/
+
+/*
+ * Manage the cursor aspect of new character insertion.
+ * Note that this function does not need to know about the memory implications
+ * of inserting a new character, it only manages the cursor positioning.
+ */
+void editorInsertChar(int c) {
+  if (E.cy == E.numrows) {
+    // If the cursor is one past the end of the file (on the new-line-tilde)
+    // add a new empty row before inserting the character
     editorInsertRow(E.numrows, "", 0);
   }
 
-  editorRowInsertChar(&E.row[E.cy], E.cx, c);
+  editorRowInsertChar(editorRowAt(E.cy), E.cx, c);
   E.cx++;
 }
 
 /*
- * Add a new row below the current cursor position containing
- * only an empty string or a null byte.
+ * Add a new row below the current cursor position containing
+ * only an empty string or a null byte.
+ */
+void editorInsertNewline(void) {
+  // Splitting the row reads its contiguous string.
+  editorGapFlush();
+
+  // If the cursor is at the start of the line, simply insert a new empty row
+  // at the current vertical position.
+  if (E.cx == 0) {
+    editorInsertRow(E.cy, "", 0);
+  } else {
+    // Copy the current row to a new memory block.
+    erow *row = editorRowAt(E.cy);
+    // Add a new row below the current row containing the characters
+    // from the current X position and right.
+    editorInsertRow(E.cy + 1, &ROW_CHARS(row)[E.cx], ROW_SIZE(row) - E.cx);
+    // truncate the current row at the cursor position
+    editorRowChanging(row);
+    editorRowSetSize(row, E.cx);
+    row->gap = E.cx;
+    // add an EOL null byte at the cursor position. A row that is still a
+    // view into the file mapping can simply be shortened.
+    if (!(ROW_FLAGS(row) & ROW_MAPPED)) {
+      editorRowOwn(row);
+      ROW_CHARS(row)[E.cx] = '\0';
+      editorRowReserve(row, E.cx + 1);
+    }
+    // Persist the updated row to the editor.
+    editorUpdateRow(row);
+  }
+  // Move the cursor down to the beginning of the next (i.e. new) line.
+  E.cy++;
+  E.cx = 0;
+}
+
+/*
+ * Manage the cursor aspect of character deletion.
+ */
+void editorDelChar(void) {
+  // Cannot delete from past the last row.
+  if (E.cy == E.numrows)
+    return;
+  // Cannot delete from the before the first row.
+  if (E.cx == 0 && E.cy == 0)
+    return;
+
+  erow *row = editorRowAt(E.cy);
+
+  if (E.cx > 0) {
+    // If the cursor is within or at the end of a given row, delete one char.
+    editorRowDelChar(row, E.cx - 1);
+    E.cx--;
+  } else {
+    // If the cursor is at the beginning of a row, move the cursor horizontally
+    // to the end of the previous row, without moving its vertical position.
+    E.cx = editorRowSize(E.cy - 1);
+
+    // Joining the rows reads the current row as one contiguous string.
+    editorGapFlush();
+
+    // Append the full contents of the current row to the end of the previous
+    // row's contents
+    editorRowAppendString(editorRowAt(E.cy - 1), ROW_CHARS(row),
+                          ROW_SIZE(row));
+
+    // Delete the current row entirely
+    editorDelRow(E.cy);
+
+    // move the cursor up one row
+    E.cy--;
+  }
+}
+
+/*** snapshots ***/
+
+/*
+ * Take a snapshot of the buffer (see struct snapshot).
+ */
+struct snapshot *editorSnapshotTake(void) {
+  // Snapshot rows are read as contiguous strings.
+  editorGapFlush();
+
+  struct snapshot *snap = malloc(sizeof(struct snapshot));
+  snap->root = E.rowroot;
+  snap->numrows = E.numrows;
+  snap->map = E.map;
+  snap->maplen = E.maplen;
+  snap->mapsize = E.mapsize;
+  snap->root->refs++;
+  E.snapshots++;
+  return snap;
+}
+
+/*
+ * Drop one tree's reference to a node, freeing the node once no tree
+ * references it. The rows' blocks are not freed here: they belong to the
+ * live tree's rows, or were handed to editorDeferFree.
+ */
+void editorNodeRelease(struct rownode *node) {
+  if (--node->refs > 0)
+    return;
+  if (!node->leaf) {
+    for (int i = 0; i < node->n; i++)
+      editorNodeRelease(node->child[i]);
+  }
+  editorLeafFreeArrays(node);
+  free(node);
+}
+
+/*
+ * Release a snapshot, along with whatever memory only it was still using.
+ */
+void editorSnapshotRelease(struct snapshot *snap) {
+  editorNodeRelease(snap->root);
+  free(snap);
+  if (--E.snapshots == 0)
+    editorDeferredFlush();
+}
+
+/*** file i/o ***/
+
+/*
+ * Handle SIGBUS. Reading a page of a mapped file that is past its end
+ * raises SIGBUS, which happens when another process truncates the file
+ * while rows still point into it. If the fault is in the buffer's mapping
+ * (or the one a background save is reading), the pages from the faulting
+ * one to the end of the mapping are replaced with zero filled ones, and the
+ * read that faulted is retried: the text that was cut off the file reads as
+ * \0 bytes instead of killing the editor, and editorMapCheck warns about
+ * it. Other faults are real bugs, and get the default action.
+ */
+void editorMapFault(int sig, siginfo_t *info, void *ucontext) {
+  (void)ucontext;
+  static long pagesize;
+  if (pagesize == 0)
+    pagesize = sysconf(_SC_PAGESIZE);
+
+  char *addr = info->si_addr;
+  char *map = E.map;
+  size_t size = E.mapsize;
+  if (!(map && addr >= map && addr < map + size))
+    editorSaveMapping(&map, &size);
+  if (map && addr >= map && addr < map + size) {
+    char *page = map + (addr - map) / pagesize * pagesize;
+    if (mmap(page, map + size - page, PROT_READ,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1,
+             0) != MAP_FAILED) {
+      E.mapfaults++;
+      return;
+    }
+  }
+  signal(sig, SIG_DFL);
+}
+
+/*
+ * Install editorMapFault.
+ */
+void editorMapGuard(void) {
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_sigaction = editorMapFault;
+  sa.sa_flags = SA_SIGINFO;
+  sigemptyset(&sa.sa_mask);
+  if (sigaction(SIGBUS, &sa, NULL) == -1)
+    die("sigaction");
+}
+
+/*
+ * Warn if the file the buffer maps was found to be truncated (see
+ * editorMapFault). The file no longer holds what the mapped rows show, so
+ * it has to be written in full the next time it is saved, and only with
+ * :w! (see editorSave), as writing back the \0 bytes would lose the text
+ * for good.
+ */
+void editorMapCheck(void) {
+  if (E.mapfaults == E.mapfaultsseen)
+    return;
+  E.mapfaultsseen = E.mapfaults;
+  E.filestknown = 0;
+  E.truncated = 1;
+  E.truncdev = E.mapdev;
+  E.truncino = E.mapino;
+  editorSetStatusMessage("WARNING!!! File was truncated on disk; the missing "
+                         "text reads as \\0 bytes");
+}
+
+/*
+ * Return whether path is a file that was truncated while the buffer mapped
+ * it (see editorMapCheck). Cutting the file off within its last page
+ * doesn't make reading the mapping fault, so the size of the mapped file is
+ * checked as well.
+ */
+int editorCheckTruncated(const char *path) {
+  struct stat st;
+  if (stat(path, &st) == -1)
+    return 0;
+  if (E.map && st.st_dev == E.mapdev && st.st_ino == E.mapino &&
+      (size_t)st.st_size < E.maplen) {
+    E.truncated = 1;
+    E.truncdev = st.st_dev;
+    E.truncino = st.st_ino;
+  }
+  return E.truncated && st.st_dev == E.truncdev && st.st_ino == E.truncino;
+}
+
+/*
+ * Release the file mapping that mapped rows point into.
+ */
+void editorUnmap(void) {
+  if (E.map == NULL)
+    return;
+  if (E.snapshots > 0)
+    editorDeferFree(E.map, E.mapsize, 1);
+  else
+    munmap(E.map, E.mapsize);
+  E.map = NULL;
+  E.maplen = 0;
+  E.mapsize = 0;
+}
+
+/*
+ * Point the mapped rows from row 'from' on at their text in base, a mapping
+ * of size bytes of the file as it was just saved (len bytes, every row
+ * followed by a newline), and make base the new E.map. This lets go of the
+ * old file, which would otherwise stay on disk for as long as it is mapped.
+ * The rows before 'from' must already point into base, which is then
+ * E.map itself, still mapping a file that was saved in place.
+ */
+void editorMapRebase(char *base, size_t len, size_t size, size_t from) {
+  size_t off = editorRowOffset(from);
+  int j;
+  for (struct rownode *leaf = editorFindLeaf(from, &j); leaf;
+       leaf = editorLeafNext(leaf), j = 0) {
+    for (; j < leaf->n; j++) {
+      // Interned rows keep pointing at their \0-terminated strings.
+      if ((leaf->flags[j] & (ROW_MAPPED | ROW_INTERNED)) == ROW_MAPPED)
+        leaf->chars[j] = &base[off];
+      off += leaf->size[j] + 1;
+    }
+  }
+
+  if (base != E.map) {
+    editorUnmap();
+    E.map = base;
+    E.mapsize = size;
+  }
+  E.maplen = len;
+}
+
+/*
+ * Record that the buffer now matches the file on disk: the dirty rows become
+ * clean, with their hashes to be worked out again when needed. They all come
+ * from E.firstdirty on.
+ */
+void editorMarkSaved(void) {
+  if (E.dirtyrows > 0) {
+    size_t first = E.firstdirty < E.numrows ? E.firstdirty : E.numrows;
+    int j;
+    for (struct rownode *leaf = editorFindLeaf(first, &j); leaf;
+         leaf = editorLeafNext(leaf), j = 0) {
+      for (; j < leaf->n; j++) {
+        if (leaf->flags[j] & ROW_DIRTY)
+          leaf->flags[j] &= ~(ROW_DIRTY | ROW_HASHED);
+      }
+    }
+  }
+  E.dirty = 0;
+  E.dirtyrows = 0;
+  E.savedrows = E.numrows;
+  E.firstdirty = SIZE_MAX;
+}
+
+/*
+ * Return whether st describes the file the buffer was last opened from or
+ * saved to, unchanged since, and that file is what saving the buffer as it
+ * was then would have written. Its rows then only need writing from
+ * E.firstdirty on, and mapped rows can be checked for being in place.
+ */
+int editorFileSame(struct stat *st) {
+  return E.filestknown && st->st_dev == E.filest.st_dev &&
+         st->st_ino == E.filest.st_ino && st->st_size == E.filest.st_size &&
+         st->st_mtim.tv_sec == E.filest.st_mtim.tv_sec &&
+         st->st_mtim.tv_nsec == E.filest.st_mtim.tv_nsec;
+}
+
+/*
+ * Return the hash of the whole buffer, made of the hashes of its rows. The
+ * rows' hashes are kept while they are clean, so this only reads the text
+ * of rows that changed or were never hashed before.
+ */
+uint64_t editorBufferHash(void) {
+  uint64_t h = 0;
+  int off;
+  for (struct rownode *leaf = editorLeafAt(0, &off); leaf; leaf = leaf->next) {
+    for (int j = 0; j < leaf->n; j++)
+      h = editorHashCombine(h, editorRowHash(leaf, j));
+  }
+  return h;
+}
+
+/*
+ * Work out the hash a file would have as a buffer (see editorBufferHash),
+ * splitting it into rows the way editorOpen does, and store it in *hash.
+ * Returns 0 on success and -1 if the file can't be read or mapped.
+ */
+int editorFileHash(const char *filename, uint64_t *hash) {
+  int fd = open(filename, O_RDONLY);
+  if (fd == -1)
+    return -1;
+  struct stat st;
+  if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) ||
+      (off_t)(size_t)st.st_size != st.st_size) {
+    close(fd);
+    return -1;
+  }
+
+  uint64_t h = 0;
+  if (st.st_size > 0) {
+    char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+      close(fd);
+      return -1;
+    }
+    char *p = map;
+    char *end = map + st.st_size;
+    while (p < end) {
+      char *nl = memchr(p, '\n', end - p);
+      size_t linelen = (nl ? nl : end) - p;
+      while (linelen > 0 && p[linelen - 1] == '\r')
+        linelen--;
+      h = editorHashCombine(h, editorHashBytes(p, linelen));
+      p = nl ? nl + 1 : end;
+    }
+    munmap(map, st.st_size);
+  }
+  close(fd);
+  *hash = h;
+  return 0;
+}
+
+/*
+ * Write out the iovcnt pieces of iov with writev(), picking up where it left
+ * off after a short write or a signal, until everything is out. The pieces
+ * are updated to track what is left to write.
+ * Returns 0 on success and -1 on error, with errno set.
+ */
+int editorWritevAll(int fd, struct iovec *iov, int iovcnt) {
+  while (iovcnt > 0) {
+    ssize_t n = writev(fd, iov, iovcnt);
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    // Skip the pieces that were written in full, and the written start of
+    // the next one.
+    while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+      n -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (char *)iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+  return 0;
+}
+
+// Newlines for rows whose own text isn't followed by one, enough for a run
+// of empty rows to share a single piece.
+static const char editorNewlines[] = "\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n"
+                                     "\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n";
+
+/*
+ * Rows being written out to a file, as a batch of pieces pointing at their
+ * text that is handed to writev() whenever it fills up, so that saving
+ * copies nothing and takes the same small amount of memory however big the
+ * file is.
+ * Rows still mapped from the file are followed there by their newline, so
+ * a run of rows that weren't edited is written as a single piece.
+ */
+struct rowwriter {
+  int fd;
+  const char *map;
+  size_t maplen;
+  struct iovec iov[KILO_SAVE_IOVS];
+  int iovcnt;
+  size_t batch;
+  size_t len;
+};
+
+/*
+ * Add len bytes at p to the batch being gathered by w, joining them to the
+ * last piece if they follow on from it. The batch is written out first if
+ * it is full.
+ * Returns 0 on success and -1 on error, with errno set.
+ */
+int editorWriterAdd(struct rowwriter *w, const char *p, size_t len) {
+  if (len == 0)
+    return 0;
+  if (w->batch + len > KILO_SAVE_BATCH && w->iovcnt > 0) {
+    if (editorWritevAll(w->fd, w->iov, w->iovcnt) == -1)
+      return -1;
+    w->iovcnt = 0;
+    w->batch = 0;
+  }
+
+  struct iovec *last = w->iovcnt > 0 ? &w->iov[w->iovcnt - 1] : NULL;
+  if (last && (char *)last->iov_base + last->iov_len == p) {
+    last->iov_len += len;
+  } else {
+    if (w->iovcnt == KILO_SAVE_IOVS) {
+      if (editorWritevAll(w->fd, w->iov, w->iovcnt) == -1)
+        return -1;
+      w->iovcnt = 0;
+      w->batch = 0;
+    }
+    w->iov[w->iovcnt].iov_base = (char *)p;
+    w->iov[w->iovcnt].iov_len = len;
+    w->iovcnt++;
+  }
+  w->batch += len;
+  w->len += len;
+  return 0;
+}
+
+/*
+ * Write the rows under a node to w, each followed by a newline.
+ * This walks the tree from the top instead of following the leaves' links,
+ * and only reads the nodes, so it can run on a snapshot from any thread.
+ * Returns 0 on success and -1 on error, with errno set.
+ */
+int editorWriteNode(struct rowwriter *w, struct rownode *node) {
+  if (!node->leaf) {
+    for (int i = 0; i < node->n; i++) {
+      if (editorWriteNode(w, node->child[i]) == -1)
+        return -1;
+    }
+    return 0;
+  }
+
+  for (int j = 0; j < node->n; j++) {
+    char *chars = node->chars[j];
+    size_t size = node->size[j];
+    if (w->map && chars >= w->map &&
+        (size_t)(chars - w->map) + size < w->maplen && chars[size] == '\n') {
+      // The newline in the file follows on from the row's text.
+      if (editorWriterAdd(w, chars, size + 1) == -1)
+        return -1;
+      continue;
+    }
+    if (editorWriterAdd(w, chars, size) == -1)
+      return -1;
+
+    // Take the newline that follows on from the last one written, if there
+    // is one, so that a run of empty rows joins up.
+    const char *nl = editorNewlines;
+    if (w->iovcnt > 0) {
+      struct iovec *last = &w->iov[w->iovcnt - 1];
+      const char *end = (char *)last->iov_base + last->iov_len;
+      if (end > editorNewlines &&
+          end < editorNewlines + sizeof(editorNewlines) - 1)
+        nl = end;
+    }
+    if (editorWriterAdd(w, nl, 1) == -1)
+      return -1;
+  }
+  return 0;
+}
+
+/*
+ * Write every row of a snapshot to fd, and store the number of bytes written
+ * in *len. Returns 0 on success and -1 on error, with errno set.
+ */
+int editorSnapshotWrite(struct snapshot *snap, int fd, size_t *len) {
+  struct rowwriter *w = malloc(sizeof(struct rowwriter));
+  w->fd = fd;
+  w->map = snap->map;
+  w->maplen = snap->maplen;
+  w->iovcnt = 0;
+  w->batch = 0;
+  w->len = 0;
+  int ret = editorWriteNode(w, snap->root);
+  if (ret == 0)
+    ret = editorWritevAll(fd, w->iov, w->iovcnt);
+  *len = w->len;
+  free(w);
+  return ret;
+}
+
+/*
+ * Write all len bytes of buf to fd at offset off, carrying on after a short
+ * write or a signal.
+ * Returns 0 on success and -1 on error, with errno set.
+ */
+int editorPwriteAll(int fd, const char *buf, size_t len, off_t off) {
+  while (len > 0) {
+    ssize_t n = pwrite(fd, buf, len, off);
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    buf += n;
+    len -= n;
+    off += n;
+  }
+  return 0;
+}
+
+/*
+ * Rows being written over a file in place, gathered into a bounce buffer of
+ * KILO_SAVE_BOUNCE bytes. The rows' text may come from the very file being
+ * written, and write() copies like memcpy(), not memmove(), so it must never
+ * be handed text to write over itself.
+ * Rows are gathered either forwards, from the start of the buffer, with off
+ * the offset in the file where they start, or backwards, last row first,
+ * from the end of the buffer, with off the offset where they end.
+ */
+struct bouncewriter {
+  int fd;
+  char *buf;
+  size_t used;
+  off_t off;
+  int back;
+  size_t written;
+};
+
+/*
+ * Write out the bytes gathered by b.
+ * Returns 0 on success and -1 on error, with errno set.
  */
-void editorInsertNewline(void) {
-  // If the cursor is at the start of the line, simply insert a new empty row
-  // at the current vertical position.
-  if (E.cx == 0) {
-    editorInsertRow(E.cy, "", 0);
+int editorBounceFlush(struct bouncewriter *b) {
+  if (b->back) {
+    b->off -= b->used;
+    if (editorPwriteAll(b->fd, &b->buf[KILO_SAVE_BOUNCE - b->used], b->used,
+                        b->off) == -1)
+      return -1;
   } else {
-    // Copy the current row to a new memory block.
-    erow *row = &E.row[E.cy];
-    // Add a new row below the current row containing the characters
-    // from the current X position and right.
-    editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
-    // truncate the current row at the cursor position
-    row = &E.row[E.cy];
-    row->size = E.cx;
-    // add an EOL null byte at the cursor position.
-    row->chars[row->size] = '\0';
-    // Persist the updated row to the editor.
-    editorUpdateRow(row);
+    if (editorPwriteAll(b->fd, b->buf, b->used, b->off) == -1)
+      return -1;
+    b->off += b->used;
   }
-  // Move the cursor down to the beginning of the next (i.e. new) line.
-  E.cy++;
-  E.cx = 0;
+  b->written += b->used;
+  b->used = 0;
+  return 0;
 }
 
 /*
- * Manage the cursor aspect of character deletion.
+ * Add len bytes at p to the bytes gathered by b (in front of them when
+ * gathering backwards), writing them out whenever the buffer fills up.
+ * Returns 0 on success and -1 on error, with errno set.
  */
-void editorDelChar(void) {
-  // Cannot delete from past the last row.
-  if (E.cy == E.numrows)
-    return;
-  // Cannot delete from the before the first row.
-  if (E.cx == 0 && E.cy == 0)
-    return;
-
-  erow *row = &E.row[E.cy];
-
-  if (E.cx > 0) {
-    // If the cursor is within or at the end of a given row, delete one char.
-    editorRowDelChar(row, E.cx - 1);
-    E.cx--;
-  } else {
-    // If the cursor is at the beginning of a row, move the cursor horizontally
-    // to the end of the previous row, without moving its vertical position.
-    E.cx = E.row[E.cy - 1].size;
-
-    // Append the full contents of the current row to the end of the previous
-    // row's contents
-    editorRowAppendString(&E.row[E.cy - 1], row->chars, row->size);
-
-    // Delete the current row entirely
-    editorDelRow(E.cy);
-
-    // move the cursor up one row
-    E.cy--;
+int editorBounceAdd(struct bouncewriter *b, const char *p, size_t len) {
+  while (len > 0) {
+    if (b->used == KILO_SAVE_BOUNCE && editorBounceFlush(b) == -1)
+      return -1;
+    size_t n = KILO_SAVE_BOUNCE - b->used;
+    if (n > len)
+      n = len;
+    if (b->back) {
+      memcpy(&b->buf[KILO_SAVE_BOUNCE - b->used - n], &p[len - n], n);
+    } else {
+      memcpy(&b->buf[b->used], p, n);
+      p += n;
+    }
+    b->used += n;
+    len -= n;
   }
+  return 0;
 }
 
-/*** file i/o ***/
+/*
+ * Write rows first to last - 1, which end at offset end in the file, last
+ * row first.
+ * Returns 0 on success and -1 on error, with errno set.
+ */
+int editorWriteBack(struct bouncewriter *b, size_t first, size_t last,
+                    off_t end) {
+  b->off = end;
+  b->back = 1;
+  size_t at = last;
+  while (at > first) {
+    int off;
+    struct rownode *leaf = editorLeafAt(at - 1, &off);
+    for (; off >= 0 && at > first; off--, at--) {
+      if (editorBounceAdd(b, "\n", 1) == -1 ||
+          editorBounceAdd(b, leaf->chars[off], leaf->size[off]) == -1)
+        return -1;
+    }
+  }
+  if (editorBounceFlush(b) == -1)
+    return -1;
+  b->off = end;
+  b->back = 0;
+  return 0;
+}
 
 /*
- * Convert the erow structs into a single string ready to be saved to disk.
+ * Write every row of the buffer over the file open as fd, in place, and
+ * store the size of the file in *len and the number of bytes written in
+ * *written.
+ * With skip set, the file is known to be the one the buffer was opened from
+ * or last saved to (see editorFileSame). The rows before E.firstdirty are
+ * then left alone, and so is any later row still mapped from the file at
+ * the place it goes, followed there by its newline. After a small edit,
+ * only the rows from the edit to the end of the file are looked at, and
+ * unless the edit changed the length of the file, only the rows that
+ * changed are written.
+ * Mapped rows may still be reading their text from that same file, so it
+ * has to be overwritten in an order that never writes over text before it
+ * is read. Rows only ever move as a whole, keeping their order, so a row
+ * whose text is at or after the place it goes can be written once the rows
+ * before it are out: nothing written so far comes after that place. Rows
+ * that moved towards the end of the file wait, together with the new rows
+ * in front of them, until such a row comes up (or the end of the buffer),
+ * and are then written backwards, like memmove() does.
+ * Returns 0 on success and -1 on error, with errno set.
  */
-char *editorRowsToString(int *buflen) {
-  int totlen = 0;
-  // Add up the bytelength of all rows in the editor.
+int editorWriteInPlace(int fd, int skip, size_t *len, size_t *written) {
+  // at is the next row, off where it goes, and waiting the first row
+  // waiting to be written backwards, if any.
+  size_t at = 0;
+  if (skip)
+    at = E.firstdirty < E.numrows ? E.firstdirty : E.numrows;
+  size_t off = editorRowOffset(at);
+  ptrdiff_t waiting = -1;
+  struct bouncewriter b = {fd, malloc(KILO_SAVE_BOUNCE), 0, off, 0, 0};
+
+  int ret = 0;
   int j;
-  for (j = 0; j < E.numrows; j++)
-    totlen += E.row[j].size + 1;
-
-  // Store the result in the input *buflen to let the caller know the result.
-  *buflen = totlen;
+  for (struct rownode *leaf = editorLeafAt(at, &j); leaf && ret == 0;
+       leaf = leaf->next, j = 0) {
+    for (; j < leaf->n && ret == 0; j++, at++) {
+      char *chars = leaf->chars[j];
+      size_t size = leaf->size[j];
+      int mapped = (leaf->flags[j] & (ROW_MAPPED | ROW_INTERNED)) == ROW_MAPPED;
+      size_t from = mapped ? (size_t)(chars - E.map) : 0;
+      if (mapped && from >= off) {
+        if (waiting >= 0) {
+          if (editorBounceFlush(&b) == -1 ||
+              editorWriteBack(&b, waiting, at, off) == -1) {
+            ret = -1;
+            break;
+          }
+          waiting = -1;
+        }
+        if (skip && from == off && from + size < E.maplen &&
+            chars[size] == '\n') {
+          // Already in place: carry on writing after it.
+          ret = editorBounceFlush(&b);
+          b.off = off + size + 1;
+        } else if (editorBounceAdd(&b, chars, size) == -1 ||
+                   editorBounceAdd(&b, "\n", 1) == -1) {
+          ret = -1;
+        }
+      } else if (waiting < 0) {
+        waiting = at;
+      }
+      off += size + 1;
+    }
+  }
 
-  // Allocate enough memory to hold the entire string.
-  // This pointer remains stationary so that the caller can `free` it
-  // afterwards.
-  char *buf = malloc(totlen);
+  if (ret == 0)
+    ret = editorBounceFlush(&b);
+  if (ret == 0 && waiting >= 0)
+    ret = editorWriteBack(&b, waiting, at, off);
+  if (ret == 0)
+    ret = ftruncate(fd, off);
+  free(b.buf);
+  *len = off;
+  *written = b.written;
+  return ret;
+}
 
-  // Store the starting location at *p, which will move as data is added.
-  char *p = buf;
-  for (j = 0; j < E.numrows; j++) {
-    // Copy the data from each row into p
-    memcpy(p, E.row[j].chars, E.row[j].size);
-    // Update the pointer to the end of the array.
-    p += E.row[j].size;
-    // Manually insert a newline char at the end of every row.
-    *p = '\n';
-    // Increment p by 1 to step over the new line.
-    p++;
+/*
+ * Free a tree node and everything below it.
+ */
+void editorNodeFree(struct rownode *node) {
+  if (!node->leaf) {
+    for (int i = 0; i < node->n; i++)
+      editorNodeFree(node->child[i]);
   }
+  editorLeafFreeArrays(node);
+  free(node);
+}
 
-  // Return buf so the caller can free it.
-  return buf;
+/*
+ * Drop the contents of the buffer, leaving an empty editor.
+ * The rows' memory goes back in one go by releasing the arena, so this costs
+ * O(chunks) rather than one free() per row.
+ */
+void editorCloseBuffer(void) {
+  editorSaveFinish();
+  editorLoadFinish(1);
+  editorNodeFree(E.rowroot);
+  editorArenaRelease();
+  editorScratchRelease();
+  editorInternRelease();
+  editorUnmap();
+  E.truncated = 0;
+  E.rowroot = editorNodeNew(1);
+  E.leafhint = NULL;
+  E.gaprow = NULL;
+  E.numrows = 0;
+  E.derivedbytes = 0;
+  E.lruhead = NULL;
+  E.lrutail = NULL;
+  E.cx = 0;
+  E.cy = 0;
+  E.rowoff = 0;
+  E.coloff = 0;
+  E.dirty = 0;
+  E.dirtyrows = 0;
+  E.savedrows = 0;
+  E.firstdirty = SIZE_MAX;
+  E.filestknown = 0;
+  E.eol = 0;
+  E.hlvalid = 0;
+  E.hlmatch_row = -1;
 }
 
 /*
@@ -1061,12 +4326,68 @@ void editorOpen(char *filename) {
   editorSelectSyntaxHighlight();
 
   // Open a file by name.
-  FILE *fp = fopen(filename, "r");
+  int fd = open(filename, O_RDONLY);
+  if (fd == -1) {
+    die("open");
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) == -1) {
+    die("fstat");
+  }
+  E.filest = st;
+  E.filestknown = 0;
+
+  // Large files get a scratch file for their row metadata. If one can't be
+  // created, the buffer just stays in memory.
+  if (S_ISREG(st.st_mode) && (size_t)st.st_size >= E.scratchmin)
+    editorScratchOpen(filename);
+
+  // Regular files are mapped rather than read, and their rows point into
+  // the mapping until they are edited. Only the pages that are looked at
+  // are read from disk. (Files that don't fit in the address space, on 32 bit
+  // systems, are read instead.)
+  if (S_ISREG(st.st_mode) && st.st_size > 0 &&
+      (off_t)(size_t)st.st_size == st.st_size) {
+    char *map = mmap(NULL, st.st_size + KILO_MAP_SLACK, PROT_READ,
+                     MAP_PRIVATE, fd, 0);
+    if (map != MAP_FAILED) {
+      close(fd);
+      E.map = map;
+      E.maplen = st.st_size;
+      E.mapsize = st.st_size + KILO_MAP_SLACK;
+      E.mapdev = st.st_dev;
+      E.mapino = st.st_ino;
+      // The file is just what saving the buffer would write, unless it has
+      // \r\n line endings (see editorLoadAppend) or no newline at the end.
+      E.filestknown = map[st.st_size - 1] == '\n';
+
+      // The rows are built in bulk, straight into the row tree. Of a large
+      // file, only the start is loaded before it is shown.
+      size_t len = st.st_size;
+      if (len > KILO_LOAD_PREFIX) {
+        char *nl = memchr(map + KILO_LOAD_PREFIX, '\n', len - KILO_LOAD_PREFIX);
+        len = nl ? (size_t)(nl + 1 - map) : len;
+      }
+      editorLoadParallel(map, len);
+      if (len < (size_t)st.st_size)
+        editorLoadStart(map + len, st.st_size - len);
+      E.dirty = 0;
+      E.savedrows = E.numrows;
+      return;
+    }
+  }
+
+  // Anything that can't be mapped (pipes, devices) is read line by line, with
+  // repeated lines sharing their text (see struct internpool).
+  FILE *fp = fdopen(fd, "r");
   if (!fp) {
-    die("fopen");
+    die("fdopen");
   }
 
   // Load one line from the file.
+  struct rowloader ld;
+  editorLoadBegin(&ld);
   char *line = NULL;
   size_t linecap = 0;
   ssize_t linelen;
@@ -1075,13 +4396,15 @@ void editorOpen(char *filename) {
   // correct *line pointer and capacity, returning the length.
   // Note: A linelen of -1 indicates the end of the file.
   while ((linelen = getline(&line, &linecap, fp)) != -1) {
-    // Strip off new lines and carriage returns.
-    while (linelen > 0 &&
-           (line[linelen - 1] == '\r' || line[linelen - 1] == '\n')) {
-      linelen--;
-    }
-    editorInsertRow(E.numrows, line, linelen);
+    // Strip off the new line and carriage returns.
+    int nl = linelen > 0 && line[linelen - 1] == '\n';
+    linelen = editorLoadStrip(&ld, line, linelen - nl, nl);
+    editorLoadRow(&ld, editorIntern(line, linelen), linelen,
+                  ROW_MAPPED | ROW_INTERNED);
   }
+  editorLoadEnd(&ld);
+  editorLoadAppend(&ld);
+  editorInternDone();
 
   // Re-free the memory allocated to the line and close the file.
   free(line);
@@ -1089,12 +4412,268 @@ void editorOpen(char *filename) {
 
   // Reset the dirty flag on open to ensure we start clean.
   E.dirty = 0;
+  E.savedrows = E.numrows;
+}
+
+/*
+ * Copy the extended attributes of the file at path (which include its ACL,
+ * if it has one) to the file open as fd. Attributes that can't be copied,
+ * such as security labels the user isn't allowed to set, are skipped. This
+ * is only done on Linux, where the xattr calls take these arguments.
+ */
+void editorCopyXattrs(const char *path, int fd) {
+#ifdef __linux__
+  ssize_t size = listxattr(path, NULL, 0);
+  if (size <= 0)
+    return;
+  char *names = malloc(size);
+  size = listxattr(path, names, size);
+  for (ssize_t i = 0; i < size; i += strlen(&names[i]) + 1) {
+    ssize_t len = getxattr(path, &names[i], NULL, 0);
+    if (len < 0)
+      continue;
+    char *value = malloc(len > 0 ? len : 1);
+    len = getxattr(path, &names[i], value, len);
+    if (len >= 0)
+      fsetxattr(fd, &names[i], value, len, 0);
+    free(value);
+  }
+  free(names);
+#else
+  (void)path;
+  (void)fd;
+#endif
+}
+
+/*
+ * Flush the directory holding path to disk, so that a file just renamed
+ * into it is still there after a crash. Errors are ignored: some file
+ * systems can't sync directories, and the file is saved either way.
+ */
+void editorSyncDir(const char *path) {
+  const char *slash = strrchr(path, '/');
+  char *dir = slash ? strndup(path, slash == path ? 1 : slash - path)
+                    : strdup(".");
+  int fd = open(dir, O_RDONLY | O_DIRECTORY);
+  if (fd != -1) {
+    fsync(fd);
+    close(fd);
+  }
+  free(dir);
+}
+
+/*
+ * A save running in the background. The rows are written from a snapshot by
+ * a separate thread, to a temporary file next to the target, while editing
+ * carries on, and flushed to disk. Once the thread is done, editorSaveFinish
+ * renames the temporary file over the target on the main thread. That way
+ * mapped rows can keep reading from the old file while the new one is
+ * written (the old file stays around for as long as it is mapped), and a
+ * failed save, or a crash at any point, leaves either the old file or the
+ * new one in place, never a mix of the two.
+ */
+struct savejob {
+  pthread_t thread;
+  int threaded;
+  struct snapshot *snap;
+  // E.dirty when the snapshot was taken, to tell whether the buffer was
+  // edited while it was being saved.
+  int dirty;
+  // Whether the save goes ahead even if the target was truncated.
+  int force;
+  int fd;
+  char *tmp;
+  char *target;
+  // Written by the thread: the result of the write, errno if it failed, and
+  // the number of bytes written. done is guarded by lock.
+  int ret;
+  int err;
+  size_t len;
+  pthread_mutex_t lock;
+  int done;
+};
+
+/*
+ * The background save thread.
+ */
+void *editorSaveThread(void *arg) {
+  struct savejob *job = arg;
+  job->ret = editorSnapshotWrite(job->snap, job->fd, &job->len);
+  if (job->ret == 0)
+    job->ret = fsync(job->fd);
+  job->err = errno;
+
+  pthread_mutex_lock(&job->lock);
+  job->done = 1;
+  pthread_mutex_unlock(&job->lock);
+  return NULL;
+}
+
+/*
+ * Wait for the background save to complete, then put the new file in place
+ * of the old one and report the result.
+ */
+void editorSaveFinish(void) {
+  struct savejob *job = E.save;
+  if (job == NULL)
+    return;
+  if (job->threaded)
+    pthread_join(job->thread, NULL);
+  editorSnapshotRelease(job->snap);
+  E.save = NULL;
+
+  // The file may have been truncated while the save was reading its
+  // mapping, in which case the rows cut off it were written as \0 bytes.
+  editorMapCheck();
+  int truncated = editorCheckTruncated(job->target);
+  if (truncated && !job->force) {
+    unlink(job->tmp);
+    editorSetStatusMessage("Can't save! File was truncated on disk (:w! "
+                           "overwrites it)");
+  } else if (job->ret == 0 && rename(job->tmp, job->target) != -1) {
+    editorSyncDir(job->target);
+    // The truncated file was replaced with what the buffer shows.
+    if (truncated)
+      E.truncated = 0;
+    E.eol = EOL_LF;
+    // Unless the buffer was edited in the meantime, it now matches the file
+    // on disk: move the mapped rows over to the new file (if it can't be
+    // mapped, they simply keep using the old one) and mark the rows clean.
+    if (E.dirty == job->dirty) {
+      E.filestknown = fstat(job->fd, &E.filest) == 0;
+      if (E.map && job->len > 0) {
+        size_t size = job->len + KILO_MAP_SLACK;
+        char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, job->fd, 0);
+        if (map != MAP_FAILED) {
+          editorMapRebase(map, job->len, size, 0);
+          E.mapdev = E.filest.st_dev;
+          E.mapino = E.filest.st_ino;
+        } else {
+          E.filestknown = 0;
+        }
+      }
+      editorMarkSaved();
+    } else {
+      E.filestknown = 0;
+    }
+    editorSetStatusMessage("%zu bytes written to disk", job->len);
+  } else {
+    int err = job->ret == 0 ? errno : job->err;
+    unlink(job->tmp);
+    editorSetStatusMessage("Can't save! I/O error: %s", strerror(err));
+  }
+
+  close(job->fd);
+  pthread_mutex_destroy(&job->lock);
+  free(job->tmp);
+  free(job->target);
+  free(job);
+}
+
+/*
+ * Store the file mapping the background save is reading from, if any, in
+ * *map and its size in *size (see editorMapFault).
+ */
+void editorSaveMapping(char **map, size_t *size) {
+  if (E.save) {
+    *map = E.save->snap->map;
+    *size = E.save->snap->mapsize;
+  }
+}
+
+/*
+ * Finish the background save if its thread is done, without waiting.
+ * Called while waiting for keypresses.
+ */
+void editorSavePoll(void) {
+  if (E.save == NULL)
+    return;
+  pthread_mutex_lock(&E.save->lock);
+  int done = E.save->done;
+  pthread_mutex_unlock(&E.save->lock);
+  if (done) {
+    editorSaveFinish();
+    editorRefreshScreen();
+  }
+}
+
+/*
+ * Save the rows over the file at target in place, instead of writing a new
+ * file and renaming it over the old one, so that saving needs no more disk
+ * space than the file itself. This is quick, but not safe: a crash or a
+ * full disk halfway through leaves a damaged file. It runs on the main
+ * thread, since mapped rows can't be read from the file while it is being
+ * overwritten.
+ */
+void editorSaveInPlace(const char *target) {
+  editorGapFlush();
+  int fd = open(target, O_RDWR);
+  struct stat st;
+  if (fd == -1 || fstat(fd, &st) == -1) {
+    editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+    if (fd != -1)
+      close(fd);
+    return;
+  }
+
+  // The mapped rows are moved over to the file as written once it is done.
+  // Unless the file is still the one E.map maps, with room for its new
+  // length, map it before writing it, so that this can't fail by then.
+  int skip = editorFileSame(&st);
+  size_t len = E.rowroot->bytes;
+  char *map = NULL;
+  size_t size = 0;
+  size_t from = 0;
+  if (E.map && len > 0) {
+    if (skip && len <= E.mapsize) {
+      map = E.map;
+      size = E.mapsize;
+      from = E.firstdirty < E.numrows ? E.firstdirty : E.numrows;
+    } else {
+      size = len + KILO_MAP_SLACK;
+      map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (map == MAP_FAILED) {
+        editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+        close(fd);
+        return;
+      }
+    }
+  }
+
+  size_t written;
+  if (editorWriteInPlace(fd, skip, &len, &written) == 0 && fsync(fd) == 0) {
+    if (map)
+      editorMapRebase(map, len, size, from);
+    editorMarkSaved();
+    E.eol = EOL_LF;
+    E.filestknown = fstat(fd, &E.filest) == 0;
+    if (map && E.filestknown) {
+      E.mapdev = E.filest.st_dev;
+      E.mapino = E.filest.st_ino;
+    }
+    // The truncated file, if this was it, now holds what the buffer shows.
+    editorMapCheck();
+    if (editorCheckTruncated(target))
+      E.truncated = 0;
+    editorSetStatusMessage("%zu bytes saved in place, %zu written", len,
+                           written);
+  } else {
+    E.filestknown = 0;
+    editorSetStatusMessage("Can't save! I/O error: %s (the file may be "
+                           "damaged)",
+                           strerror(errno));
+    if (map && map != E.map)
+      munmap(map, size);
+  }
+  close(fd);
 }
 
 /*
- * Write the string generated by editorRowsToString to disk.
+ * Start saving the rows to disk, under the current file name (see struct
+ * savejob). A file that was truncated while the buffer mapped it is only
+ * saved over if force is set.
  */
-void editorSave(void) {
+void editorSave(int force) {
   // If this is not an existing file, we don't know where to save it, so
   // prompt the user for a name, and use that.
   if (E.filename == NULL) {
@@ -1108,38 +4687,97 @@ void editorSave(void) {
     editorSelectSyntaxHighlight();
   }
 
-  // Convert the editor rows to a string.
-  int len;
-  char *buf = editorRowsToString(&len);
+  // Only one save runs at a time, and it saves the whole file.
+  editorSaveFinish();
+  editorLoadWait();
+
+  // Replace the file a symlink points to, not the symlink itself.
+  char *target = realpath(E.filename, NULL);
+  if (target == NULL)
+    target = strdup(E.filename);
+
+  // Saving over a truncated file would write \0 bytes in place of the text
+  // that was cut off it. Another file name (:w <file>) is fine.
+  editorMapCheck();
+  if (!force && editorCheckTruncated(target)) {
+    free(target);
+    editorSetStatusMessage("Can't save! File was truncated on disk; use :w "
+                           "<file>, or :w!");
+    return;
+  }
 
-  // Open the known file nam  as writable, or create a new one.
-  // 0644 is a permissions object allowing the file owner to r/w
-  // but limiting to read only for other users.
-  int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
-  if (fd != -1) {
-    // Set the file's size to the length set in editorRowstoString
-    if (ftruncate(fd, len) != -1) {
-      // Write the results to disk.
-      if (write(fd, buf, len) == len) {
-        close(fd);
-        free(buf);
-        // Reset the dirty flag on every save.
-        E.dirty = 0;
-        editorSetStatusMessage("%d bytes written to disk", len);
-        return;
-      }
+  // The file being replaced keeps its owner, permissions and extended
+  // attributes. A new file gets 0644, a permissions object allowing the file
+  // owner to r/w but limiting to read only for other users (less whatever
+  // the umask takes away).
+  struct stat st;
+  int exists = stat(target, &st) == 0;
+  mode_t mode;
+  if (exists) {
+    mode = st.st_mode & 07777;
+  } else {
+    mode_t mask = umask(0);
+    umask(mask);
+    mode = 0644 & ~mask;
+  }
+
+  // Files too big to have a second copy on disk are saved in place.
+  if (exists && S_ISREG(st.st_mode) && (size_t)st.st_size >= E.inplacesize) {
+    editorSaveInPlace(target);
+    free(target);
+    return;
+  }
+
+  size_t tmplen = strlen(target) + sizeof(".kilo-XXXXXX");
+  char *tmp = malloc(tmplen);
+  snprintf(tmp, tmplen, "%s.kilo-XXXXXX", target);
+
+  int fd = mkstemp(tmp);
+  // Only root can give a file away, but the group can often be kept. The
+  // owner is set first, as changing it can clear the set-user-ID bit.
+  if (fd != -1 && exists && fchown(fd, st.st_uid, st.st_gid) == -1)
+    fchown(fd, -1, st.st_gid);
+  if (fd != -1 && exists)
+    editorCopyXattrs(target, fd);
+  if (fd == -1 || fchmod(fd, mode) == -1) {
+    int saved_errno = errno;
+    if (fd != -1) {
+      close(fd);
+      unlink(tmp);
     }
-    close(fd);
+    free(tmp);
+    free(target);
+    editorSetStatusMessage("Can't save! I/O error: %s", strerror(saved_errno));
+    return;
   }
 
-  free(buf);
-  editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+  struct savejob *job = calloc(1, sizeof(struct savejob));
+  job->fd = fd;
+  job->tmp = tmp;
+  job->target = target;
+  job->dirty = E.dirty;
+  job->force = force;
+  job->snap = editorSnapshotTake();
+  pthread_mutex_init(&job->lock, NULL);
+  E.save = job;
+  job->threaded =
+      pthread_create(&job->thread, NULL, editorSaveThread, job) == 0;
+  if (!job->threaded) {
+    // Without a thread, save right here instead.
+    editorSaveThread(job);
+    editorSaveFinish();
+    return;
+  }
+  editorSetStatusMessage("Saving...");
 }
 
 /*
  * Clear the screen and successfully close the editor
  */
 void editorQuit(void) {
+  // Let a background save complete.
+  editorSaveFinish();
+
   // Clear the screen.
   write(STDOUT_FILENO, "\x1b[2J", 4);
   write(STDOUT_FILENO, "\x1b[H", 3);
@@ -1155,22 +4793,13 @@ void editorQuit(void) {
  */
 void editorFindCallback(char *query, int key) {
   // The index of the row containing the most recent match.
-  static int last_match = -1;
+  static ptrdiff_t last_match = -1;
   // The direction to search,
   // where 1 = forwards from the cursor and -1 = backwards
   static int direction = 1;
 
-  // Prepare to store the row index of the match row so that highlighting can
-  // be applied and removed.
-  static int saved_hl_line;
-  static char *saved_hl = NULL;
-
-  // Reset any current highlighting before finding the next match.
-  if (saved_hl) {
-    memcpy(E.row[saved_hl_line].hl, saved_hl, E.row[saved_hl_line].rsize);
-    free(saved_hl);
-    saved_hl = NULL;
-  }
+  // Reset any current match highlighting before finding the next match.
+  E.hlmatch_row = -1;
 
   if (key == '\r' || key == '\x1b') {
     last_match = -1;
@@ -1187,10 +4816,10 @@ void editorFindCallback(char *query, int key) {
 
   if (last_match == -1)
     direction = 1;
-  int current = last_match;
+  ptrdiff_t current = last_match;
 
   // Iterate through every row in the editor.
-  int i;
+  size_t i;
   for (i = 0; i < E.numrows; i++) {
     // move the "current" index forward or backward (depending on direction)
     // and begin the search again from there
@@ -1198,34 +4827,35 @@ void editorFindCallback(char *query, int key) {
     if (current == -1)
       // If this is the first search case, start looking from the top.
       current = E.numrows - 1;
-    else if (current == E.numrows)
+    else if ((size_t)current == E.numrows)
       // If we hit the end of the file, restart at the top.
       current = 0;
 
     // Search the row at the 'current' index rather than the raw loop index.
-    erow *row = &E.row[current];
+    // Searching only needs the row's rendered text, not its highlighting.
+    erow *row = editorRowAt(current);
+    editorRenderRow(row);
+    editorRowTouch(row);
 
     // Check each row to see if a match is found.
     char *match = strstr(row->render, query);
     if (match) {
+      size_t match_rx = match - row->render;
       // If yes, jump to the first match instance
       last_match = current;
       E.cy = current;
       // Move the cursor horizontally to the beginning of the match
-      E.cx = editorRowRxToCx(row, match - row->render);
+      E.cx = editorRowRxToCx(row, match_rx);
       // Set the row offset to the bottom of the screen so that on the next
       // screen refresh the current cursor position is placed at the top of
       // the screen.
       E.rowoff = E.numrows;
 
-      // Apply syntax highlighting to the found matches.
-      saved_hl_line = current;
-      saved_hl = malloc(row->rsize);
-      memcpy(saved_hl, row->hl, row->rsize);
-
-      // Set all of the found characters' HL statuses to HL_MATCH
-      // for highlighting
-      memset(&row->hl[match - row->render], HL_MATCH, strlen(query));
+      // Highlight the found characters as HL_MATCH. This is laid over the
+      // row's highlighting when it is drawn, so the row itself is untouched.
+      E.hlmatch_row = current;
+      E.hlmatch_rx = match_rx;
+      E.hlmatch_len = strlen(query);
       break;
     }
   }
@@ -1235,11 +4865,14 @@ void editorFindCallback(char *query, int key) {
  * Prompt the user to perform a search and pass the input to editorFindCallback
  */
 void editorFind(void) {
+  // Search the whole file.
+  editorLoadWait();
+
   // Save the pre-search cursor position so we can return to it on cancel.
-  int saved_cx = E.cx;
-  int saved_cy = E.cy;
-  int saved_coloff = E.coloff;
-  int saved_rowoff = E.rowoff;
+  size_t saved_cx = E.cx;
+  size_t saved_cy = E.cy;
+  size_t saved_coloff = E.coloff;
+  size_t saved_rowoff = E.rowoff;
 
   // Prompt the user for a search string stored at *query
   char *query =
@@ -1306,7 +4939,7 @@ void editorScroll(void) {
   // match the character count, like '\t' taking KILO_TAB_STOP spaces.
   E.rx = 0;
   if (E.cy < E.numrows) {
-    E.rx = editorRowCxToRx(&E.row[E.cy], E.cx);
+    E.rx = editorRowCxToRx(editorRowAt(E.cy), E.cx);
   }
 
   // Cursor is above the vertical window.
@@ -1325,7 +4958,7 @@ void editorScroll(void) {
   }
 
   // Cursor is right of the horizontal window
-  if (E.rx >= E.coloff + E.screencols) {
+  if (E.rx >= E.coloff + (size_t)E.screencols) {
     E.coloff = E.rx - E.screencols + 1;
   }
 }
@@ -1339,7 +4972,7 @@ void editorScroll(void) {
 void editorDrawRows(struct abuf *ab) {
   int y;
   for (y = 0; y < E.screenrows; y++) {
-    int filerow = y + E.rowoff;
+    size_t filerow = y + E.rowoff;
     if (filerow >= E.numrows) {
       // Generate a welcome message if no user rows are present.
       if (E.numrows == 0 && y == E.screenrows / 3) {
@@ -1369,15 +5002,13 @@ void editorDrawRows(struct abuf *ab) {
     } else {
       // Print the rows as-is but truncate the text to the terminal window,
       // accounting for the column offset to allow for horizontal scrolling.
-      int len = E.row[filerow].rsize - E.coloff;
-      if (len < 0)
-        len = 0;
-      if (len > E.screencols)
+      erow *row = editorRowHighlighted(filerow);
+      size_t len = row->rsize > E.coloff ? row->rsize - E.coloff : 0;
+      if (len > (size_t)E.screencols)
         len = E.screencols;
 
-      // Store the currently visible row text in c and hl
-      char *c = &E.row[filerow].render[E.coloff];
-      unsigned char *hl = &E.row[filerow].hl[E.coloff];
+      // Store the currently visible row text in c
+      char *c = &row->render[E.coloff];
 
       int current_color = -1;
 
@@ -1385,15 +5016,51 @@ void editorDrawRows(struct abuf *ab) {
       const int row_number_digits = KILO_ROW_NUMBER_DIGITS;
 
       char rowNumber[row_number_digits + 2] = "       ";
-      snprintf(rowNumber, row_number_digits, "%d", E.row[filerow].idx + 1);
+      snprintf(rowNumber, row_number_digits, "%zu", filerow + 1);
       abAppend(ab, "\x1b[90m", 5);
       abAppend(ab, rowNumber, row_number_digits + 2);
       abAppend(ab, "\x1b[m", 3);
 
-      // Iterate through every character in the visible row and apply styling.
-      int j;
-      for (j = 0; j < len; j++) {
-        if (iscntrl(c[j])) {
+      // Walk the visible row one highlight run at a time, setting the color
+      // once per run.
+      size_t j = 0;
+      while (j < len) {
+        size_t end;
+        int hl = editorRowHlRun(row, filerow, E.coloff + j, &end);
+        end -= E.coloff;
+        if (end > len)
+          end = len;
+
+        if (hl == HL_NORMAL) {
+          if (current_color != -1) {
+            // Only reset text coloring if it's been applied.
+            abAppend(ab, "\x1b[39m", 5);
+            current_color = -1;
+          }
+        } else {
+          // Find the correct color for the run.
+          int color = editorSyntaxToColor(hl);
+          // Check if the current color is already being applied.
+          if (color != current_color) {
+            current_color = color;
+            // Create a char buf to hold the color setting string.
+            char buf[16];
+            int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
+            abAppend(ab, buf, clen);
+          }
+        }
+
+        while (j < end) {
+          // Add the printable characters up to the next non-printable one
+          // in one go.
+          size_t k = j;
+          while (k < end && !iscntrl(c[k]))
+            k++;
+          abAppend(ab, &c[j], k - j);
+          j = k;
+          if (j == end)
+            break;
+
           // If we hit a non-printable character,
           // print Alpha ctrl chars as capital letters by adding them
           // to '@', which converts the <c-a> to A .. <c-z> to Z
@@ -1412,26 +5079,7 @@ void editorDrawRows(struct abuf *ab) {
             int clen = snprintf(buf, sizeof(buf), "\x1b[%dm]", current_color);
             abAppend(ab, buf, clen);
           }
-        } else if (hl[j] == HL_NORMAL) {
-          if (current_color != -1) {
-            // Only reset text coloring if it's been applied.
-            abAppend(ab, "\x1b[39m", 5);
-            current_color = -1;
-          }
-          abAppend(ab, &c[j], 1);
-        } else {
-          // Find the correct color for the character.
-          int color = editorSyntaxToColor(hl[j]);
-          // Check if the current color is already being applied.
-          if (color != current_color) {
-            current_color = color;
-            // Create a char buf to hold the color setting string.
-            char buf[16];
-            int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
-            // Add the color setting string and character to the row.
-            abAppend(ab, buf, clen);
-          }
-          abAppend(ab, &c[j], 1);
+          j++;
         }
       }
       // Reset all text coloring.
@@ -1462,13 +5110,37 @@ void editorDrawStatusBar(struct abuf *ab) {
   // Add the current line number, right aligned
   char rstatus[80];
 
-  int len = snprintf(status, sizeof(status), "--%s-- | %.20s - %d lines %s",
-                     E.mode == MODE_INSERT ? "INSERT" : "NORMAL",
-                     E.filename ? E.filename : "[No Name]", E.numrows,
-                     E.dirty ? "(modified)" : "");
-  int rlen =
-      snprintf(rstatus, sizeof(rstatus), "%s | %d/%d",
-               E.syntax ? E.syntax->filetype : "no ft", E.cy + 1, E.numrows);
+  int len;
+  if (E.load) {
+    // Show how far the background load has got.
+    pthread_mutex_lock(&E.load->lock);
+    size_t bytes = E.rowroot->bytes + E.load->bytes;
+    size_t rows = E.numrows + E.load->rows;
+    pthread_mutex_unlock(&E.load->lock);
+    len = snprintf(status, sizeof(status),
+                   "--%s-- | %.20s - loading %zu/%zu MB, %zu lines %s",
+                   E.mode == MODE_INSERT ? "INSERT" : "NORMAL",
+                   E.filename ? E.filename : "[No Name]", bytes >> 20,
+                   E.maplen >> 20, rows, editorModified() ? "(modified)" : "");
+  } else {
+    len = snprintf(status, sizeof(status), "--%s-- | %.20s - %zu lines %s",
+                   E.mode == MODE_INSERT ? "INSERT" : "NORMAL",
+                   E.filename ? E.filename : "[No Name]", E.numrows,
+                   editorModified() ? "(modified)" : "");
+  }
+  // Include the cursor's byte offset in the file, unless that doesn't fit
+  // or can't be worked out (see editorEolExtra).
+  int extra = editorEolExtra();
+  int rlen = 0;
+  if (extra >= 0)
+    rlen = snprintf(rstatus, sizeof(rstatus), "%s | byte %zu | %zu/%zu",
+                    E.syntax ? E.syntax->filetype : "no ft",
+                    editorRowOffset(E.cy) + E.cy * extra + E.cx,
+                    E.cy + 1, E.numrows);
+  if (extra < 0 || len + rlen > E.screencols)
+    rlen =
+        snprintf(rstatus, sizeof(rstatus), "%s | %zu/%zu",
+                 E.syntax ? E.syntax->filetype : "no ft", E.cy + 1, E.numrows);
   // Truncate the status to fit on the screen, just in case
   if (len > E.screencols)
     len = E.screencols;
@@ -1521,6 +5193,7 @@ void editorDrawMessageBar(struct abuf *ab) {
  *   [?l / [?h - toggle off/on terminal "modes" (using 25 for cursor vis).
  */
 void editorRefreshScreen(void) {
+  editorMapCheck();
   editorScroll();
 
   struct abuf ab = ABUF_INIT;
@@ -1535,8 +5208,8 @@ void editorRefreshScreen(void) {
 
   // Move the cursor to the stored X, Y position.
   char buf[32];
-  snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cy - E.rowoff) + 1,
-           (E.rx - E.coloff) + 1);
+  snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (int)(E.cy - E.rowoff) + 1,
+           (int)(E.rx - E.coloff) + 1);
   abAppend(&ab, buf, strlen(buf));
 
   // Un-hide the cursor.
@@ -1633,7 +5306,7 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
  */
 void editorMoveCursor(int key) {
   // Limit the cursor veritcally to 1 past the end of the file.
-  erow *row = (E.cy > E.numrows) ? NULL : &E.row[E.cy];
+  size_t rowlen = editorRowSize(E.cy);
 
   switch (key) {
   case ARROW_LEFT:
@@ -1641,7 +5314,7 @@ void editorMoveCursor(int key) {
       E.cx--;
     } else if (E.cy > 0) {
       E.cy--;
-      E.cx = E.row[E.cy].size;
+      E.cx = editorRowSize(E.cy);
     }
     break;
   case ARROW_DOWN:
@@ -1650,9 +5323,9 @@ void editorMoveCursor(int key) {
     }
     break;
   case ARROW_RIGHT:
-    if (row && E.cx < row->size) {
+    if (E.cy < E.numrows && E.cx < rowlen) {
       E.cx++;
-    } else if (row && E.cx == row->size) {
+    } else if (E.cy < E.numrows && E.cx == rowlen) {
       E.cy++;
       E.cx = 0;
     }
@@ -1667,8 +5340,7 @@ void editorMoveCursor(int key) {
   // Correct the cursor's horizontal position when vertical scrolling would
   // place the cursor in a horizontally invalid position (such as from a longer
   // line to a shorter one)
-  row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
-  int rowlen = row ? row->size : 0;
+  rowlen = editorRowSize(E.cy);
   if (E.cx > rowlen) {
     // If the cursor would be put in a bad spot, snap it to the end of the line
     E.cx = rowlen;
@@ -1686,17 +5358,29 @@ void editorProcessCommand(char *command) {
   }
 
   if (strcmp(command, "wq") == 0) {
-    // :wq - save and quit
-    if (E.dirty) {
-      editorSave();
+    // :wq - save and quit, unless the save fails or is refused
+    if (editorModified()) {
+      editorSave(0);
+      editorSaveFinish();
     }
-    editorQuit();
+    if (!editorModified())
+      editorQuit();
   } else if (strcmp(command, "w") == 0) {
     // :w - save
-    editorSave();
+    editorSave(0);
+  } else if (strcmp(command, "w!") == 0) {
+    // :w! - save, even over a file that was truncated on disk
+    editorSave(1);
+  } else if (strncmp(command, "w ", 2) == 0) {
+    // :w <file> - save under another name, which the buffer then has
+    editorSaveFinish();
+    free(E.filename);
+    E.filename = strdup(&command[2]);
+    editorSelectSyntaxHighlight();
+    editorSave(0);
   } else if (strcmp(command, "q") == 0) {
     // :q - quit if there are no pending changes
-    if (E.dirty) {
+    if (editorModified()) {
       editorSetStatusMessage("WARNING!!! File has unsaved changes. "
                              "Use :q! to quit without saving");
     } else {
@@ -1705,6 +5389,47 @@ void editorProcessCommand(char *command) {
   } else if (strcmp(command, "q!") == 0) {
     // :q! - quit regardless
     editorQuit();
+  } else if (strncmp(command, "e ", 2) == 0) {
+    // :e <file> - replace the buffer with another file
+    if (editorModified()) {
+      editorSetStatusMessage("WARNING!!! File has unsaved changes. "
+                             "Save with :w first");
+    } else if (access(&command[2], R_OK) != 0) {
+      editorSetStatusMessage("Can't open %s: %s", &command[2],
+                             strerror(errno));
+    } else {
+      editorCloseBuffer();
+      editorOpen(&command[2]);
+    }
+  } else if (strncmp(command, "goto-byte ", 10) == 0) {
+    // :goto-byte <offset> - jump to a byte offset in the file, counted from
+    // 0 (as printed by grep -b, for example)
+    char *end;
+    editorLoadWait();
+    errno = 0;
+    unsigned long long off = strtoull(&command[10], &end, 10);
+    if (end == &command[10] || *end != '\0' || errno != 0) {
+      editorSetStatusMessage("Bad byte offset: %s", &command[10]);
+    } else if (editorEolExtra() < 0) {
+      editorSetStatusMessage("Can't go to a byte offset: the file mixes \\n "
+                             "and \\r\\n line endings");
+    } else {
+      E.cy = editorOffsetRow(off, editorEolExtra(), &E.cx);
+    }
+  } else if (strcmp(command, "hash") == 0) {
+    // :hash - show the hash of the buffer, and whether the file on disk
+    // has the same contents
+    editorLoadWait();
+    unsigned long long h = editorBufferHash();
+    uint64_t fh;
+    if (E.filename && editorFileHash(E.filename, &fh) == 0)
+      editorSetStatusMessage("hash %016llx, %s the file on disk", h,
+                             h == fh ? "same as" : "differs from");
+    else
+      editorSetStatusMessage("hash %016llx", h);
+  } else if (strcmp(command, "mem") == 0) {
+    // :mem - show row memory statistics
+    editorArenaStats();
   }
 
   E.mode = MODE_NORMAL;
@@ -1728,7 +5453,7 @@ void editorProcessKeyPress(void) {
       break;
     case END_KEY:
       if (E.cy < E.numrows)
-        E.cx = E.row[E.cy].size;
+        E.cx = editorRowSize(E.cy);
       break;
 
     case BACKSPACE:
@@ -1818,6 +5543,7 @@ void editorProcessKeyPress(void) {
       break;
     case 'G':
       // Scroll to the bottom of the page and place the cursor at the bottom.
+      editorLoadWait();
       E.cy = E.numrows;
       break;
 
@@ -1827,10 +5553,14 @@ void editorProcessKeyPress(void) {
       break;
     case '^':
       if (E.cy < E.numrows)
-        E.cx = E.row[E.cy].size;
+        E.cx = editorRowSize(E.cy);
       break;
     }
   }
+
+  // Compact the row being edited once the cursor has left it.
+  if (E.gaprow && editorRowIndex(E.gaprow) != E.cy)
+    editorGapFlush();
 }
 
 /*** init ***/
@@ -1853,11 +5583,48 @@ void initEditor(void) {
   // Start with no text rows.
   E.numrows = 0;
 
-  // Init the row pointer to NULL to allow for dynamic resizing.
-  E.row = NULL;
+  // Init the row tree to a single empty leaf.
+  E.rowroot = editorNodeNew(1);
+  E.leafhint = NULL;
+  E.leafhint_at = 0;
+
+  // No row is being edited yet.
+  E.gaprow = NULL;
+
+  // Start with an empty row arena, and no scratch file unless a file large
+  // enough is opened.
+  memset(&E.arena, 0, sizeof(E.arena));
+  E.scratch.fd = -1;
+  pthread_mutex_init(&E.scratch.lock, NULL);
+  E.scratchmin = KILO_SCRATCH_MIN;
+
+  // Nothing has been highlighted yet, and there is no search match to show.
+  E.hlvalid = 0;
+  E.hlmatch_row = -1;
+
+  // No file is mapped, loaded or saved yet, and files are only saved in
+  // place when --save-in-place is given.
+  E.save = NULL;
+  E.inplacesize = SIZE_MAX;
+  E.load = NULL;
+  E.map = NULL;
+  E.maplen = 0;
+  E.mapsize = 0;
+  E.truncated = 0;
+
+  // No derived data yet, and no memory ceiling unless --mem-limit is given.
+  E.derivedbytes = 0;
+  E.memlimit = 0;
+  E.lruhead = NULL;
+  E.lrutail = NULL;
 
   // Init the dirty flag to 0 / Off when we start
   E.dirty = 0;
+  E.dirtyrows = 0;
+  E.savedrows = 0;
+  E.firstdirty = SIZE_MAX;
+  E.filestknown = 0;
+  E.eol = 0;
 
   // Init the filename pointer to NULL to allow for dynamic resizing.
   E.filename = NULL;
@@ -1878,12 +5645,183 @@ void initEditor(void) {
   E.screenrows -= 2;
 }
 
+/*
+ * Parse a size such as "512M" (with an optional K, M or G suffix) into
+ * *size. Returns 0 on success and -1 if s isn't a valid size.
+ */
+int editorParseSize(const char *s, size_t *size) {
+  char *end;
+  errno = 0;
+  unsigned long long n = strtoull(s, &end, 10);
+  if (end == s || errno != 0 || *s == '-')
+    return -1;
+
+  int shift = 0;
+  switch (*end) {
+  case 'K':
+  case 'k':
+    shift = 10;
+    break;
+  case 'M':
+  case 'm':
+    shift = 20;
+    break;
+  case 'G':
+  case 'g':
+    shift = 30;
+    break;
+  case '\0':
+    break;
+  default:
+    return -1;
+  }
+  if (shift && end[1] != '\0')
+    return -1;
+  if (n > (SIZE_MAX >> shift))
+    return -1;
+
+  *size = (size_t)n << shift;
+  return 0;
+}
+
+/*
+ * Return the seconds elapsed since start.
+ */
+double editorBenchSince(struct timespec *start) {
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  return (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/*
+ * Open a file without taking over the terminal, and report how long that
+ * took, and how long scans over all of its rows take (for make bench).
+ * With saveas set, the buffer is then saved to that file, for checking that
+ * it comes back unchanged (for make test-large).
+ */
+int editorBenchOpen(char *filename, char *saveas) {
+  E.rowroot = editorNodeNew(1);
+  E.hlmatch_row = -1;
+  E.scratch.fd = -1;
+  pthread_mutex_init(&E.scratch.lock, NULL);
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  editorOpen(filename);
+  editorLoadFinish(0);
+  double secs = editorBenchSince(&start);
+  size_t bytes = E.rowroot->bytes;
+  printf("%s: %zu rows, %zu bytes in %.3f s (%.2f GB/s)\n", filename,
+         E.numrows, bytes, secs, bytes / secs / 1e9);
+  if (E.numrows == 0)
+    return 0;
+
+  // Scans over every row stream through the leaves' parallel arrays (see
+  // struct rownode). For comparison, the same sum of row sizes is also
+  // worked out looking each row up by its number.
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  size_t total = 0;
+  int off;
+  for (struct rownode *leaf = editorLeafAt(0, &off); leaf; leaf = leaf->next) {
+    for (int j = 0; j < leaf->n; j++)
+      total += leaf->size[j];
+  }
+  secs = editorBenchSince(&start);
+  printf("sum of row sizes, leaf by leaf: %.2f ns/row\n",
+         secs * 1e9 / E.numrows);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  size_t lookedup = 0;
+  for (size_t at = 0; at < E.numrows; at++)
+    lookedup += editorRowSize(at);
+  secs = editorBenchSince(&start);
+  printf("sum of row sizes, row by row: %.2f ns/row\n",
+         secs * 1e9 / E.numrows);
+  if (total != lookedup || total + E.numrows != bytes)
+    printf("row sizes don't add up: %zu, %zu\n", total, lookedup);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  editorInvalidateHighlight();
+  secs = editorBenchSince(&start);
+  printf("invalidate highlighting: %.2f ns/row\n", secs * 1e9 / E.numrows);
+
+  // Hashing reads the text of every row, and then keeps the hashes.
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  uint64_t h = editorBufferHash();
+  secs = editorBenchSince(&start);
+  printf("hash %016llx: %.2f ns/row (%.2f GB/s)\n", (unsigned long long)h,
+         secs * 1e9 / E.numrows, bytes / secs / 1e9);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  editorBufferHash();
+  secs = editorBenchSince(&start);
+  printf("hash again: %.2f ns/row\n", secs * 1e9 / E.numrows);
+
+  if (saveas) {
+    free(E.filename);
+    E.filename = strdup(saveas);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    editorSave(0);
+    editorSaveFinish();
+    secs = editorBenchSince(&start);
+    printf("save to %s: %s, in %.3f s\n", saveas, E.statusmsg, secs);
+  }
+  return 0;
+}
+
 int main(int argc, char *argv[]) {
+  // Read the options before taking over the terminal, so that errors can be
+  // printed normally.
+  char *filename = NULL;
+  size_t memlimit = 0;
+  size_t inplacesize = SIZE_MAX;
+  size_t scratchmin = KILO_SCRATCH_MIN;
+  int bench = 0;
+  char *benchsave = NULL;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--bench-open") == 0) {
+      bench = 1;
+    } else if (strncmp(argv[i], "--bench-save=", 13) == 0) {
+      benchsave = &argv[i][13];
+    } else if (strncmp(argv[i], "--mem-limit=", 12) == 0) {
+      if (editorParseSize(&argv[i][12], &memlimit) == -1) {
+        fprintf(stderr, "kilo: invalid --mem-limit: %s\n", &argv[i][12]);
+        return 1;
+      }
+    } else if (strncmp(argv[i], "--save-in-place=", 16) == 0) {
+      if (editorParseSize(&argv[i][16], &inplacesize) == -1) {
+        fprintf(stderr, "kilo: invalid --save-in-place: %s\n", &argv[i][16]);
+        return 1;
+      }
+    } else if (strncmp(argv[i], "--scratch=", 10) == 0) {
+      if (editorParseSize(&argv[i][10], &scratchmin) == -1) {
+        fprintf(stderr, "kilo: invalid --scratch: %s\n", &argv[i][10]);
+        return 1;
+      }
+    } else {
+      filename = argv[i];
+    }
+  }
+
+  if (bench) {
+    if (filename == NULL) {
+      fprintf(stderr, "kilo: --bench-open needs a file\n");
+      return 1;
+    }
+    E.inplacesize = inplacesize;
+    E.scratchmin = scratchmin;
+    return editorBenchOpen(filename, benchsave);
+  }
+
   enableRawMode();
   initEditor();
+  editorMapGuard();
+  E.memlimit = memlimit;
+  E.inplacesize = inplacesize;
+  E.scratchmin = scratchmin;
   // If a file name is provided, pass it to editor open.
-  if (argc >= 2) {
-    editorOpen(argv[1]);
+  if (filename) {
+    editorOpen(filename);
   }
 
   editorSetStatusMessage("HELP: :w = save | :q = quit | / = find");